@@ -0,0 +1,188 @@
+-- workloads for src/bench.c; each run() returns the number of rows it touched
+
+local c = sqlite3.open_memory()
+
+local ROWS = 10000
+local WIDE_ROWS = 1000
+local WIDE_COLS = 30
+
+c:exec("create table kv(id integer primary key, v text)")
+
+local cols = {}
+for i = 1, WIDE_COLS do cols[i] = "c" .. i end
+c:exec("create table wide(" .. table.concat(cols, ", ") .. ")")
+
+local holders = {}
+for i = 1, WIDE_COLS do holders[i] = "?" end
+local p = c:prepare("insert into wide values(" .. table.concat(holders, ", ") .. ")")
+c:begin()
+for r = 1, WIDE_ROWS do
+	local vals = {}
+	for i = 1, WIDE_COLS do
+		if i % 3 == 0 then
+			vals[i] = r * i
+		elseif i % 3 == 1 then
+			vals[i] = r / i
+		else
+			vals[i] = string.rep("x", 64) .. r
+		end
+	end
+	p:bind(vals)
+	p:exec_update()
+end
+c:commit()
+p:finalize()
+
+-- every scan reuses one statement, so run() times only the stepping
+local function scan(name, body)
+	local s
+	return {
+		name = "scan_" .. name,
+		iterations = 200,
+		setup = function() s = c:prepare("select * from wide") end,
+		run = function()
+			s:reset()
+			return body(s)
+		end,
+		teardown = function() s:finalize() end,
+	}
+end
+
+local function step_all(method)
+	return function(s)
+		local n = 0
+		local row = s[method](s)
+		while row do
+			n = n + 1
+			row = s[method](s)
+		end
+		return n
+	end
+end
+
+local insert, lookup, udf, agg, bind
+
+return {
+	{
+		name = "bulk_insert",
+		iterations = ROWS,
+		setup = function()
+			insert = c:prepare("insert into kv(id, v) values(:id, :v)")
+			c:begin()
+		end,
+		run = function(i)
+			insert:bind {id = i, v = "value" .. i}
+			return insert:exec_update()
+		end,
+		teardown = function()
+			c:commit()
+			insert:finalize()
+		end,
+	},
+	{
+		name = "point_lookup",
+		iterations = ROWS,
+		setup = function() lookup = c:prepare("select * from kv where id = ?") end,
+		run = function(i)
+			lookup:bind {(i * 7919) % ROWS + 1}
+			return lookup:fetch() and 1 or 0
+		end,
+		teardown = function() lookup:finalize() end,
+	},
+	scan("fetch", step_all("fetch")),
+	scan("ifetch", step_all("ifetch")),
+	scan("rows", function(s)
+		local n = 0
+		for row in s:rows() do n = n + 1 end
+		return n
+	end),
+	scan("lazy_rows", function(s)
+		local n = 0
+		for row in s:lazy_rows() do
+			local _ = row.c1, row.c2, row.c30
+			n = n + 1
+		end
+		return n
+	end),
+	{
+		name = "scalar_udf",
+		iterations = 200,
+		setup = function()
+			c:set_function("bench_udf", 1, function(a) return a[1] end)
+			udf = c:prepare("select bench_udf(c3) from wide")
+		end,
+		run = function()
+			udf:reset()
+			local n = 0
+			while udf:ifetch() do n = n + 1 end
+			return n
+		end,
+		teardown = function()
+			udf:finalize()
+			c:set_function("bench_udf")
+		end,
+	},
+	{
+		name = "aggregate",
+		iterations = 200,
+		setup = function()
+			c:set_aggregate("bench_sum", 1,
+				function(a, r) r[1] = (r[1] or 0) + a[1] end,
+				function(r) return r[1] end)
+			agg = c:prepare("select bench_sum(c3) from wide")
+		end,
+		run = function()
+			agg:reset()
+			agg:ifetch()
+			return WIDE_ROWS
+		end,
+		teardown = function()
+			agg:finalize()
+			c:set_aggregate("bench_sum")
+		end,
+	},
+	scan("encode_json", function(s)
+		local _, n = s:encode_json()
+		return n
+	end),
+	scan("encode_msgpack", function(s)
+		local _, n = s:encode_msgpack {arrays = true}
+		return n
+	end),
+	{
+		name = "cached_aggregate",
+		iterations = 2000,
+		setup = function()
+			c:set_result_cache(4 * 1024 * 1024)
+			agg = c:prepare("select count(*), sum(c3), avg(c6) from wide")
+			agg:set_cacheable(true)
+		end,
+		run = function()
+			agg:reset()
+			agg:ifetch_all()
+			return 1
+		end,
+		teardown = function()
+			agg:finalize()
+			c:set_result_cache(nil)
+		end,
+	},
+	{
+		name = "bind_heavy",
+		iterations = ROWS,
+		setup = function()
+			local names = {}
+			for i = 1, 16 do names[i] = ":p" .. i end
+			bind = c:prepare("select " .. table.concat(names, ", "))
+		end,
+		run = function(i)
+			bind:bind {
+				p1 = i, p2 = "a", p3 = i + 0.5, p4 = "b", p5 = i, p6 = "c", p7 = i, p8 = "d",
+				p9 = i, p10 = "e", p11 = i, p12 = "f", p13 = i, p14 = "g", p15 = i, p16 = "h",
+			}
+			bind:ifetch()
+			return 1
+		end,
+		teardown = function() bind:finalize() end,
+	},
+}
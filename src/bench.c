@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lsqlite3lib.h"
+#include "lualib.h"
+#include "lauxlib.h"
+#include "sqlite3.h"
+
+/*
+ * bench [script [workload ...]]
+ *
+ * Loads script (default bench.lua), which returns an array of workloads:
+ *   { name = "...", iterations = n, setup = function() end,
+ *     run = function(i) return rows end, teardown = function() end }
+ * Every call to run() is timed on its own; one JSON object per workload is
+ * written to stdout.
+ */
+
+typedef struct {
+	size_t allocs;
+	size_t bytes;
+} alloc_stats;
+
+static void* bench_alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+	alloc_stats* st = (alloc_stats*)ud;
+	if(nsize == 0) {
+		free(ptr);
+		return NULL;
+	}
+	if(ptr == NULL || nsize > osize) {
+		st->allocs++;
+		st->bytes += ptr == NULL ? nsize : nsize - osize;
+	}
+	return realloc(ptr, nsize);
+}
+
+static int bench_panic(lua_State* L) {
+	fprintf(stderr, "PANIC: %s\n", lua_tostring(L, -1));
+	return 0;
+}
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static int cmp_double(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static double percentile(const double* sorted, int n, double p) {
+	int i = (int)(p * (n - 1) + 0.5);
+	return sorted[i];
+}
+
+static void put_json_string(const char* p) {
+	putchar('"');
+	for(; *p; p++) {
+		unsigned char ch = (unsigned char)*p;
+		if(ch == '"' || ch == '\\') printf("\\%c", ch);
+		else if(ch < 0x20) printf("\\u%04x", ch);
+		else putchar(ch);
+	}
+	putchar('"');
+}
+
+static int selected(int argc, char** argv, const char* name) {
+	int i;
+	if(argc < 3) return 1;
+	for(i = 2; i < argc; i++) {
+		if(strcmp(argv[i], name) == 0) return 1;
+	}
+	return 0;
+}
+
+static int call_field(lua_State* L, int idx, const char* field) {
+	lua_getfield(L, idx, field);
+	if(!lua_isfunction(L, -1)) {
+		lua_pop(L, 1);
+		return LUA_OK;
+	}
+	return lua_pcall(L, 0, 0, 0);
+}
+
+static int run_workload(lua_State* L, alloc_stats* st, int idx) {
+	const char* name;
+	int iterations;
+	int i;
+	long long rows = 0;
+	double* lat;
+	double total = 0;
+	alloc_stats before;
+	int kb_before;
+	int top = lua_gettop(L);
+	int failed = 1;
+
+	lua_getfield(L, idx, "name");
+	name = lua_tostring(L, -1);
+	lua_getfield(L, idx, "iterations");
+	iterations = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	if(iterations <= 0) iterations = 1;
+
+	if(call_field(L, idx, "setup") != LUA_OK) {
+		fprintf(stderr, "%s: setup: %s\n", name, lua_tostring(L, -1));
+		goto done;
+	}
+
+	if((lat = malloc(sizeof(double) * iterations)) == NULL) {
+		fprintf(stderr, "%s: out of memory\n", name);
+		goto done;
+	}
+
+	lua_gc(L, LUA_GCCOLLECT, 0);
+	sqlite3_memory_highwater(1);
+	kb_before = lua_gc(L, LUA_GCCOUNT, 0);
+	before = *st;
+
+	for(i = 0; i < iterations; i++) {
+		double t0, t1;
+		lua_getfield(L, idx, "run");
+		lua_pushinteger(L, i + 1);
+		t0 = now_ns();
+		if(lua_pcall(L, 1, 1, 0) != LUA_OK) {
+			fprintf(stderr, "%s: run: %s\n", name, lua_tostring(L, -1));
+			free(lat);
+			goto done;
+		}
+		t1 = now_ns();
+		rows += lua_isnumber(L, -1) ? lua_tointeger(L, -1) : 1;
+		lua_pop(L, 1);
+		lat[i] = t1 - t0;
+		total += lat[i];
+	}
+
+	qsort(lat, iterations, sizeof(double), cmp_double);
+
+	printf("{\"workload\":");
+	put_json_string(name);
+	printf(",\"iterations\":%d,\"rows\":%lld,"
+			"\"seconds\":%.6f,\"rows_per_sec\":%.1f,"
+			"\"latency_ns\":{\"p50\":%.0f,\"p90\":%.0f,\"p99\":%.0f,\"max\":%.0f},"
+			"\"lua_allocs\":%lu,\"lua_alloc_bytes\":%lu,\"lua_mem_delta_kb\":%d,"
+			"\"sqlite_mem_used\":%lld,\"sqlite_mem_highwater\":%lld}\n",
+			iterations, rows,
+			total / 1e9, total > 0 ? rows / (total / 1e9) : 0.0,
+			percentile(lat, iterations, 0.50), percentile(lat, iterations, 0.90),
+			percentile(lat, iterations, 0.99), lat[iterations - 1],
+			(unsigned long)(st->allocs - before.allocs),
+			(unsigned long)(st->bytes - before.bytes),
+			lua_gc(L, LUA_GCCOUNT, 0) - kb_before,
+			(long long)sqlite3_memory_used(), (long long)sqlite3_memory_highwater(0));
+	fflush(stdout);
+	free(lat);
+
+	if(call_field(L, idx, "teardown") != LUA_OK) {
+		fprintf(stderr, "%s: teardown: %s\n", name, lua_tostring(L, -1));
+		goto done;
+	}
+	failed = 0;
+
+done:
+	lua_settop(L, top);
+	return failed;
+}
+
+int main(int argc, char** argv) {
+	alloc_stats st = {0, 0};
+	const char* script = argc > 1 ? argv[1] : "bench.lua";
+	lua_State* L = lua_newstate(bench_alloc, &st);
+	int failed = 0;
+	int i, n;
+
+	if(L == NULL) return EXIT_FAILURE;
+	lua_atpanic(L, bench_panic);
+	luaL_openlibs(L);
+
+	luaL_requiref(L, "sqlite3", luaopen_sqlite3, 1);
+	lua_pop(L, 1);  /* remove lib */
+
+	if(luaL_loadfile(L, script) != LUA_OK || lua_pcall(L, 0, 1, 0) != LUA_OK) {
+		fprintf(stderr, "%s\n", lua_tostring(L, -1));
+		lua_close(L);
+		return EXIT_FAILURE;
+	}
+	if(!lua_istable(L, -1)) {
+		fprintf(stderr, "%s: must return a table of workloads\n", script);
+		lua_close(L);
+		return EXIT_FAILURE;
+	}
+
+	n = luaL_len(L, -1);
+	for(i = 1; i <= n; i++) {
+		lua_rawgeti(L, -1, i);
+		lua_getfield(L, -1, "name");
+		if(lua_isstring(L, -1) && selected(argc, argv, lua_tostring(L, -1))) {
+			failed |= run_workload(L, &st, lua_gettop(L) - 1);
+		}
+		lua_pop(L, 2);
+	}
+
+	lua_close(L);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -2,39 +2,131 @@
 
 #include "lauxlib.h"
 #include "sqlite3.h"
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define LUA_FUNC(f) static int f(lua_State* L)
 
 typedef struct lsqlite3lib_conn conn;
 typedef struct lsqlite3lib_stmt stmt;
+typedef struct lsqlite3lib_row row;
 typedef struct lsqlite3lib_func func;
+typedef struct lsqlite3lib_change change;
+typedef struct lsqlite3lib_cache_entry cache_entry;
+typedef struct lsqlite3lib_result_cache result_cache;
+typedef struct lsqlite3lib_abort_record abort_record;
+typedef struct lsqlite3lib_vtab vtab;
+typedef struct lsqlite3lib_cursor cursor;
+typedef struct lsqlite3lib_array array;
+typedef struct lsqlite3lib_array_cursor array_cursor;
 
 #define MT_CONN "sqlite3:connection"
 #define MT_STMT "sqlite3:prepared_statement"
+#define MT_ROW  "sqlite3:row"
 
-#define IDX_STMT_TABLE     1
-#define IDX_FUNCTION_TABLE 2
-#define IDX_CALLBACK_TABLE 3
+#define IDX_FUNCTION_TABLE 1
+#define IDX_CALLBACK_TABLE 2
+#define IDX_MODULE_TABLE   3
+#define IDX_BUFFER_TABLE   4
+#define IDX_COLLATION_TABLE 5
+#define IDX_WRITE_QUEUE    6
 
 #define IDX_FUNC_ROLLBACK_HOOK    1
 #define IDX_FUNC_COMMIT_HOOK      2
 #define IDX_FUNC_TRACE_CALLBACK   3
 #define IDX_FUNC_PROFILE_CALLBACK 4
+#define IDX_FUNC_UPDATE_HOOK      5
+#define IDX_FUNC_WAL_HOOK         6
 
 #define IDX_FUNC_XFUNC            1
 #define IDX_FUNC_XSTEP            2
 #define IDX_FUNC_XFINAL           3
 
+struct lsqlite3lib_change {
+	int op;
+	int table; /* index into conn.tables */
+	sqlite3_int64 rowid;
+};
+
+#define ABORT_LOG_SIZE 16
+
+struct lsqlite3lib_abort_record {
+	char* sql;
+	sqlite3_int64 elapsed_ms;
+	sqlite3_int64 opcodes;
+	int timed_out; /* 0 when stopped by c:interrupt() */
+};
+
 struct lsqlite3lib_conn {
 	sqlite3* handle;
 	lua_State* L;
 	int ref;
+
+	/* live statements; not referenced from Lua so they can be collected */
+	stmt* stmts;
+	int n_stmts;
+
+	/*
+	 * row changes, see set_update_hook: the first n_committed belong to
+	 * committed transactions not yet delivered, the rest to the current one
+	 */
+	int update_hook;
+	change* changes;
+	int n_changes;
+	int n_committed;
+	int cap_changes;
+	int max_changes;
+	int changes_overflow;
+	int committed_overflow;
+	char** tables;
+	int n_tables;
+	int last_table;
+
+	result_cache* cache; /* see set_result_cache */
+
+	/* query deadlines, see set_default_timeout and stmt:set_timeout */
+	int default_timeout;
+	int progress_handler;
+	sqlite3_int64 deadline;
+	int timed_out;
+	sqlite3_int64 ticks;
+	abort_record aborts[ABORT_LOG_SIZE];
+	int n_aborts;
+
+	/*
+	 * ref to the first error of a callback SQLite gives no way to fail
+	 * with, such as a collation; raised once the step or exec returns
+	 */
+	int hook_error;
+
+	/* group commit, see submit_write */
+	int write_count;
+	int write_max_count;
+	int write_max_delay; /* ms */
+	sqlite3_int64 write_first;
+	int write_error; /* ref to the first callback error flush_writes has not raised yet */
 };
 
 struct lsqlite3lib_stmt {
 	sqlite3_stmt* handle;
 	conn* c;
+	unsigned generation; /* bumped on every step and reset, wraps around */
+	int cacheable; /* opted into the result cache with set_cacheable */
+	int uncacheable; /* has pointer bindings the result cache can't key on */
+	unsigned char* params; /* bound values for the result cache key, see stmtlib_bind */
+	size_t params_len;
+	int timeout; /* ms, 0 uses the connection default */
+	sqlite3_int64 started; /* start of the current execution */
+	int timed_out; /* the last step was stopped by a deadline */
+	stmt* prev; /* conn.stmts list */
+	stmt* next;
+};
+
+struct lsqlite3lib_row {
+	stmt* s;
+	unsigned generation; /* valid while equal to s->generation */
 };
 
 struct lsqlite3lib_func {
@@ -42,20 +134,101 @@ struct lsqlite3lib_func {
 	char* func_name;
 };
 
+struct lsqlite3lib_vtab {
+	sqlite3_vtab base;
+	conn* c;
+	int ref; /* module implementation table */
+};
+
+struct lsqlite3lib_cursor {
+	sqlite3_vtab_cursor base;
+	int ref; /* cursor object returned by impl:open() */
+	int eof;
+	sqlite3_int64 rowid;
+};
+
+static sqlite3_module lsqlite3lib_carray_module;
+static void result_cache_free(result_cache* rc);
+static void deliver_changes(lua_State* L, conn* c);
+
+/*
+ * Native collations registered on every connection:
+ *   NATSORT          runs of digits compare by numeric value ("a2" < "a10")
+ *   NATSORT_NOCASE   NATSORT with ASCII case folding
+ *   VERSION          NATSORT_NOCASE, where '~' and '-' sort before
+ *                    everything, even the end ("1.0~beta" < "1.0-rc1" < "1.0")
+ */
+#define IS_DIGIT(ch) ((ch) >= '0' && (ch) <= '9')
+#define FOLD(ch) ((ch) >= 'A' && (ch) <= 'Z' ? (ch) + ('a' - 'A') : (ch))
+
+/* sort key of a non-digit byte, the end of the string is 0 */
+static int collation_key(int ch, int nocase, int version) {
+	if(version && ch == '~') return -2;
+	if(version && ch == '-') return -1;
+	return nocase ? FOLD(ch) + 1 : ch + 1;
+}
+
+static int natural_compare(const unsigned char* a, int na, const unsigned char* b, int nb,
+		int nocase, int version) {
+	int i = 0;
+	int j = 0;
+
+	while(i < na && j < nb) {
+		if(IS_DIGIT(a[i]) && IS_DIGIT(b[j])) {
+			int si, sj, ret;
+			while(i < na && a[i] == '0') i++;
+			while(j < nb && b[j] == '0') j++;
+			si = i;
+			sj = j;
+			while(i < na && IS_DIGIT(a[i])) i++;
+			while(j < nb && IS_DIGIT(b[j])) j++;
+			if(i - si != j - sj) return i - si < j - sj ? -1 : 1;
+			if((ret = memcmp(a + si, b + sj, i - si)) != 0) return ret < 0 ? -1 : 1;
+		} else {
+			int ca = collation_key(a[i], nocase, version);
+			int cb = collation_key(b[j], nocase, version);
+			if(ca != cb) return ca < cb ? -1 : 1;
+			i++;
+			j++;
+		}
+	}
+	if(i < na) return collation_key(a[i], nocase, version) < 0 ? -1 : 1;
+	if(j < nb) return collation_key(b[j], nocase, version) < 0 ? 1 : -1;
+	return 0;
+}
+
+int lsqlite3lib_natural_collation(void* p, int n1, const void* s1, int n2, const void* s2) {
+	return natural_compare(s1, n1, s2, n2, 0, 0);
+}
+
+int lsqlite3lib_natural_nocase_collation(void* p, int n1, const void* s1, int n2, const void* s2) {
+	return natural_compare(s1, n1, s2, n2, 1, 0);
+}
+
+int lsqlite3lib_version_collation(void* p, int n1, const void* s1, int n2, const void* s2) {
+	return natural_compare(s1, n1, s2, n2, 1, 1);
+}
+
 static int conn_open(lua_State* L, const char* filename) {
 	conn* c = (conn*)lua_newuserdata(L, sizeof(conn));
-	int ret = sqlite3_open(filename, &c->handle);
+	int ret;
+
+	memset(c, 0, sizeof(conn));
+	c->write_max_count = 100;
+	c->write_max_delay = 10;
+	ret = sqlite3_open(filename, &c->handle);
 
 	if(ret != SQLITE_OK) {
 		lua_pushfstring(L, "[%d] %s", ret, sqlite3_errmsg(c->handle));
 		sqlite3_close(c->handle);
 		return lua_error(L);
 	}
+	sqlite3_create_module(c->handle, "carray", &lsqlite3lib_carray_module, NULL);
+	sqlite3_create_collation(c->handle, "NATSORT", SQLITE_UTF8, NULL, lsqlite3lib_natural_collation);
+	sqlite3_create_collation(c->handle, "NATSORT_NOCASE", SQLITE_UTF8, NULL, lsqlite3lib_natural_nocase_collation);
+	sqlite3_create_collation(c->handle, "VERSION", SQLITE_UTF8, NULL, lsqlite3lib_version_collation);
 
-	lua_createtable(L, 3, 0);
-
-	lua_newtable(L);
-	lua_rawseti(L, -2, IDX_STMT_TABLE);
+	lua_createtable(L, 6, 0);
 
 	lua_newtable(L);
 	lua_rawseti(L, -2, IDX_FUNCTION_TABLE);
@@ -63,6 +236,18 @@ static int conn_open(lua_State* L, const char* filename) {
 	lua_newtable(L);
 	lua_rawseti(L, -2, IDX_CALLBACK_TABLE);
 
+	lua_newtable(L);
+	lua_rawseti(L, -2, IDX_MODULE_TABLE);
+
+	lua_newtable(L);
+	lua_rawseti(L, -2, IDX_BUFFER_TABLE);
+
+	lua_newtable(L);
+	lua_rawseti(L, -2, IDX_COLLATION_TABLE);
+
+	lua_newtable(L);
+	lua_rawseti(L, -2, IDX_WRITE_QUEUE);
+
 	c->L = L;
 	c->ref = luaL_ref(L, LUA_REGISTRYINDEX);
 
@@ -99,34 +284,94 @@ static const luaL_Reg sqlite3lib[] = {
 	{NULL, NULL}
 };
 
+static void stmt_link(conn* c, stmt* s) {
+	s->c = c;
+	s->prev = NULL;
+	s->next = c->stmts;
+	if(c->stmts) c->stmts->prev = s;
+	c->stmts = s;
+	c->n_stmts++;
+}
+
+static void stmt_unlink(stmt* s) {
+	conn* c = s->c;
+	if(s->prev) s->prev->next = s->next;
+	else c->stmts = s->next;
+	if(s->next) s->next->prev = s->prev;
+	s->prev = s->next = NULL;
+	s->c = NULL;
+	c->n_stmts--;
+	sqlite3_free(s->params);
+	s->params = NULL;
+}
+
+static int flush_writes(lua_State* L, conn* c, const char* abandon, int callbacks);
+
 LUA_FUNC(connlib_close) {
 	int ret;
+	int i;
 	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
 
-	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
-	lua_rawgeti(L, -1, IDX_STMT_TABLE);
+	/* also the __gc metamethod, so closing twice is fine */
+	if(c->handle == NULL) return 0;
 
-	lua_pushnil(L);
-	while(lua_next(L, -2)) {
-		stmt* s = luaL_testudata(L, -1, MT_STMT);
-		if(s && s->handle) {
-			if((ret = sqlite3_finalize(s->handle)) != SQLITE_OK) {
-				return luaL_error(L, "[%d] %s", ret, sqlite3_errmsg(c->handle));
-			}
-			s->handle = NULL;
-			s->c = NULL;
-		}
-		lua_pop(L, 1);
+	if(c->write_count > 0) {
+		flush_writes(L, c, sqlite3_get_autocommit(c->handle) ? NULL
+				: "connection closed inside a transaction", 1);
+	}
+	if(c->write_error) {
+		luaL_unref(L, LUA_REGISTRYINDEX, c->write_error);
+		c->write_error = 0;
+	}
+	if(c->hook_error) {
+		luaL_unref(L, LUA_REGISTRYINDEX, c->hook_error);
+		c->hook_error = 0;
+	}
+
+	/* finalize reports the last step's error, which is not a failure to close */
+	while(c->stmts) {
+		stmt* s = c->stmts;
+		sqlite3_stmt* handle = s->handle;
+		stmt_unlink(s);
+		s->handle = NULL;
+		sqlite3_finalize(handle);
+	}
+
+	if(c->cache) {
+		result_cache_free(c->cache);
+		c->cache = NULL;
 	}
 
 	if((ret = sqlite3_close(c->handle)) != SQLITE_OK) {
 		return luaL_error(L, "[%d] %s", ret, sqlite3_errmsg(c->handle));
 	}
+	c->handle = NULL;
 	luaL_unref(L, LUA_REGISTRYINDEX, c->ref);
+	c->ref = LUA_NOREF;
+
+	sqlite3_free(c->changes);
+	c->changes = NULL;
+	c->n_changes = c->cap_changes = 0;
+	while(c->n_tables > 0) sqlite3_free(c->tables[--c->n_tables]);
+	sqlite3_free(c->tables);
+	c->tables = NULL;
+	for(i = 0; i < ABORT_LOG_SIZE; i++) {
+		sqlite3_free(c->aborts[i].sql);
+		c->aborts[i].sql = NULL;
+	}
 
 	return 0;
 }
 
+/* the collector must not run Lua code: queued writes fail without callbacks */
+LUA_FUNC(connlib_gc) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	if(c->handle && c->write_count > 0) {
+		flush_writes(L, c, "connection collected with writes queued", 0);
+	}
+	return connlib_close(L);
+}
+
 LUA_FUNC(connlib_prepare) {
 	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
 	const char* sql = luaL_checkstring(L, 2);
@@ -138,21 +383,113 @@ LUA_FUNC(connlib_prepare) {
 		sqlite3_finalize(s->handle);
 		return lua_error(L);
 	}
-	s->c = c;
+	s->generation = 0;
+	s->cacheable = 0;
+	s->uncacheable = 0;
+	s->params = NULL;
+	s->params_len = 0;
+	s->timeout = 0;
+	s->started = 0;
+	s->timed_out = 0;
+	stmt_link(c, s);
 
-	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
-	lua_rawgeti(L, -1, IDX_STMT_TABLE);
+	luaL_setmetatable(L, MT_STMT);
+	return 1;
+}
 
-	lua_pushlightuserdata(L, s->handle);
-	lua_pushvalue(L, -4);
-	lua_rawset(L, -3);
+/*
+ * returns {sql, busy, readonly} for every statement not yet finalized,
+ * including unreachable ones the garbage collector has not got to yet
+ */
+LUA_FUNC(connlib_statements) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	stmt* s;
+	int i = 0;
+
+	lua_createtable(L, c->n_stmts, 0);
+	for(s = c->stmts; s; s = s->next) {
+		lua_createtable(L, 0, 3);
+		lua_pushstring(L, sqlite3_sql(s->handle));
+		lua_setfield(L, -2, "sql");
+		lua_pushboolean(L, sqlite3_stmt_busy(s->handle));
+		lua_setfield(L, -2, "busy");
+		lua_pushboolean(L, sqlite3_stmt_readonly(s->handle));
+		lua_setfield(L, -2, "readonly");
+		lua_rawseti(L, -2, ++i);
+	}
+	return 1;
+}
 
-	lua_pop(L, 2);
+/*
+ * Deadlines: while a statement (or exec) with a timeout runs, the progress
+ * handler compares a monotonic clock with conn.deadline every
+ * PROGRESS_OPCODES VM instructions and interrupts the query once it is
+ * past. A query run from a callback of another one (a function, virtual
+ * table or hook) saves the outer deadline and restores it when it returns,
+ * and never runs past it. Interrupted queries are remembered in a small
+ * ring, see c:aborted_queries().
+ */
+#define PROGRESS_OPCODES 1000
+
+static sqlite3_int64 now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (sqlite3_int64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	luaL_setmetatable(L, MT_STMT);
+int lsqlite3lib_progress_callback(void* p) {
+	conn* c = (conn*)p;
+	c->ticks++;
+	if(c->deadline != 0 && now_ms() >= c->deadline) {
+		c->timed_out = 1;
+		return 1;
+	}
+	return 0;
+}
+
+/* deadline of a query started now, no later than the one it runs inside of */
+static sqlite3_int64 query_deadline(conn* c, sqlite3_int64 started, int timeout) {
+	sqlite3_int64 deadline = timeout > 0 ? started + timeout : 0;
+	if(c->deadline != 0 && (deadline == 0 || c->deadline < deadline)) return c->deadline;
+	return deadline;
+}
+
+static void install_progress_handler(conn* c) {
+	if(!c->progress_handler) {
+		sqlite3_progress_handler(c->handle, PROGRESS_OPCODES, lsqlite3lib_progress_callback, c);
+		c->progress_handler = 1;
+	}
+}
+
+static void record_abort(conn* c, const char* sql, sqlite3_int64 started, sqlite3_int64 opcodes) {
+	abort_record* a = &c->aborts[c->n_aborts % ABORT_LOG_SIZE];
+	sqlite3_free(a->sql);
+	a->sql = sqlite3_mprintf("%s", sql ? sql : "");
+	a->elapsed_ms = now_ms() - started;
+	a->opcodes = opcodes;
+	a->timed_out = c->timed_out;
+	c->n_aborts++;
+}
+
+/* pops the error of a callback into conn.hook_error, later ones are dropped */
+static void keep_hook_error(conn* c) {
+	if(c->hook_error) lua_pop(c->L, 1);
+	else c->hook_error = luaL_ref(c->L, LUA_REGISTRYINDEX);
+}
+
+/* pushes and clears the kept callback error; returns 0 when there is none */
+static int take_hook_error(lua_State* L, conn* c) {
+	if(!c->hook_error) return 0;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->hook_error);
+	luaL_unref(L, LUA_REGISTRYINDEX, c->hook_error);
+	c->hook_error = 0;
 	return 1;
 }
 
+static int timeout_error(lua_State* L, int ms) {
+	return luaL_error(L, "[%d] timeout: query exceeded %d ms", SQLITE_INTERRUPT, ms);
+}
+
 int lsqlite3lib_exec_callback(void* p, int n,char** argv,char** colname) {
 	int i;
 	conn* c = (conn*)p;
@@ -176,16 +513,42 @@ static int exec(lua_State* L, const char* sql) {
 	int has_callback = lua_isfunction(L, 3);
 	char* errmsg;
 	int ret;
+	sqlite3_int64 started = now_ms();
+	sqlite3_int64 outer_deadline = c->deadline;
+	int outer_timed_out = c->timed_out;
+	sqlite3_int64 outer_ticks = c->ticks;
+	int timed_out;
+
+	c->timed_out = 0;
+	c->ticks = 0;
+	c->deadline = query_deadline(c, started, c->default_timeout);
 	if(has_callback) {
 		ret = sqlite3_exec(c->handle, sql, lsqlite3lib_exec_callback, c, &errmsg);
 	} else {
 		ret = sqlite3_exec(c->handle, sql, NULL, NULL, &errmsg);
 	}
+	timed_out = c->timed_out;
+	if(ret == SQLITE_INTERRUPT) record_abort(c, sql, started, c->ticks * PROGRESS_OPCODES);
+	c->deadline = outer_deadline;
+	c->timed_out = outer_timed_out;
+	c->ticks += outer_ticks;
+
+	if(take_hook_error(L, c)) {
+		sqlite3_free(errmsg);
+		deliver_changes(L, c);
+		return lua_error(L);
+	}
+	if(ret == SQLITE_INTERRUPT && timed_out) {
+		sqlite3_free(errmsg);
+		return timeout_error(L, c->default_timeout);
+	}
 	if(ret != SQLITE_OK) {
 		lua_pushfstring(L, "[%d] %s", ret, sqlite3_errmsg(c->handle));
 		sqlite3_free(errmsg);
+		deliver_changes(L, c); /* statements before the failing one may have committed */
 		return lua_error(L);
 	}
+	deliver_changes(L, c);
 	return 0;
 }
 
@@ -226,6 +589,43 @@ LUA_FUNC(connlib_rollback) {
 }
 
 
+LUA_FUNC(connlib_interrupt) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	sqlite3_interrupt(c->handle);
+	return 0;
+}
+
+/* c:set_default_timeout(ms) applies to exec and to statements without their own timeout */
+LUA_FUNC(connlib_set_default_timeout) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	c->default_timeout = luaL_optint(L, 2, 0);
+	if(c->default_timeout > 0) install_progress_handler(c);
+	return 0;
+}
+
+/* returns {sql, elapsed_ms, opcodes, timed_out} of recently interrupted queries, oldest first */
+LUA_FUNC(connlib_aborted_queries) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	int first = c->n_aborts > ABORT_LOG_SIZE ? c->n_aborts - ABORT_LOG_SIZE : 0;
+	int i;
+
+	lua_createtable(L, c->n_aborts - first, 0);
+	for(i = first; i < c->n_aborts; i++) {
+		abort_record* a = &c->aborts[i % ABORT_LOG_SIZE];
+		lua_createtable(L, 0, 4);
+		lua_pushstring(L, a->sql);
+		lua_setfield(L, -2, "sql");
+		lua_pushinteger(L, a->elapsed_ms);
+		lua_setfield(L, -2, "elapsed_ms");
+		lua_pushinteger(L, a->opcodes);
+		lua_setfield(L, -2, "opcodes");
+		lua_pushboolean(L, a->timed_out);
+		lua_setfield(L, -2, "timed_out");
+		lua_rawseti(L, -2, i - first + 1);
+	}
+	return 1;
+}
+
 LUA_FUNC(connlib_in_transaction) {
 	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
 	lua_pushboolean(L, sqlite3_get_autocommit(c->handle) == 0 ? 1 : 0);
@@ -233,116 +633,607 @@ LUA_FUNC(connlib_in_transaction) {
 }
 
 
-void lsqlite3lib_rollback_callback(void* p) {
-	conn* c = (conn*)p;
-	lua_rawgeti(c->L, LUA_REGISTRYINDEX, c->ref);
-	lua_rawgeti(c->L, -1, IDX_CALLBACK_TABLE);
+/*
+ * Result cache: fetch_all results of read-only statements that opted in
+ * with stmt:set_cacheable(true), keyed by the statement SQL and the exact
+ * bound values, stored in a compact encoding. Every commit on this
+ * connection clears it, as does a change of PRAGMA data_version (commits
+ * by other connections to the main database), deserialize, and replacing
+ * a function, collation or module. Only opt in statements whose result
+ * depends on the database alone: not on Lua virtual tables, random(),
+ * 'now' or functions with side effects.
+ */
+#define CACHE_BUCKETS 1024
+
+enum {
+	ENC_INTEGER = 1,
+	ENC_FLOAT,
+	ENC_TEXT,
+	ENC_NULL
+};
 
-	lua_pushinteger(c->L, IDX_FUNC_ROLLBACK_HOOK);
-	lua_rawget(c->L, -2); /* fnction */
-	lua_call(c->L, 0, 0);
-	lua_pop(c->L, 2);
-}
+struct lsqlite3lib_cache_entry {
+	cache_entry* hash_next;
+	cache_entry* prev; /* LRU list, head is the most recently used */
+	cache_entry* next;
+	unsigned hash;
+	size_t size; /* entry + key + data */
+	size_t data_len;
+	size_t key_len;
+	unsigned char* key;
+	unsigned char* data;
+};
 
-LUA_FUNC(connlib_set_rollback_hook) {
-	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+struct lsqlite3lib_result_cache {
+	cache_entry* buckets[CACHE_BUCKETS];
+	cache_entry* head;
+	cache_entry* tail;
+	size_t bytes;
+	size_t budget;
+	int entries;
+	sqlite3_stmt* data_version;
+	int version;
+	lua_Integer hits;
+	lua_Integer misses;
+	lua_Integer evictions;
+	lua_Integer invalidations;
+};
 
-	if(lua_gettop(L) > 1 && lua_isfunction(L, 2)) {
-		sqlite3_rollback_hook(c->handle, lsqlite3lib_rollback_callback, c);
+typedef struct {
+	unsigned char* p;
+	size_t n;
+	size_t cap;
+	int oom;
+} enc_buffer;
+
+static void enc_put(enc_buffer* b, const void* p, size_t n) {
+	if(b->oom) return;
+	if(b->n + n > b->cap) {
+		size_t cap = b->cap ? b->cap : 256;
+		unsigned char* q;
+		while(b->n + n > cap) cap *= 2;
+		if((q = sqlite3_realloc64(b->p, cap)) == NULL) {
+			b->oom = 1;
+			return;
+		}
+		b->p = q;
+		b->cap = cap;
+	}
+	memcpy(b->p + b->n, p, n);
+	b->n += n;
+}
 
-		lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
-		lua_rawgeti(L, -1, IDX_CALLBACK_TABLE);
+static void enc_put_int(enc_buffer* b, int v) {
+	enc_put(b, &v, sizeof(int));
+}
 
-		lua_pushinteger(L, IDX_FUNC_ROLLBACK_HOOK);
-		lua_pushvalue(L, 2); /* push function */
-		lua_rawset(L, -3);
+static void enc_put_column(enc_buffer* b, sqlite3_stmt* st, int i) {
+	unsigned char tag;
+	switch(sqlite3_column_type(st, i)) {
+	case SQLITE_INTEGER: {
+			sqlite3_int64 v = sqlite3_column_int64(st, i);
+			tag = ENC_INTEGER;
+			enc_put(b, &tag, 1);
+			enc_put(b, &v, sizeof(v));
+			break;
+		}
+	case SQLITE_FLOAT: {
+			double v = sqlite3_column_double(st, i);
+			tag = ENC_FLOAT;
+			enc_put(b, &tag, 1);
+			enc_put(b, &v, sizeof(v));
+			break;
+		}
+	case SQLITE_TEXT:
+	case SQLITE_BLOB: {
+			const void* p = sqlite3_column_blob(st, i);
+			tag = ENC_TEXT;
+			enc_put(b, &tag, 1);
+			enc_put_int(b, sqlite3_column_bytes(st, i));
+			enc_put(b, p, sqlite3_column_bytes(st, i));
+			break;
+		}
+	case SQLITE_NULL:
+	default:
+		tag = ENC_NULL;
+		enc_put(b, &tag, 1);
+		break;
+	}
+}
 
-	} else {
-		sqlite3_rollback_hook(c->handle, NULL, NULL);
+/* data: int col_count, col_count * (int len, name), int row_count, values */
+static void cache_decode(lua_State* L, const unsigned char* p, int mode) {
+	int col_count, row_count, i, j;
+	const unsigned char* names;
+
+	memcpy(&col_count, p, sizeof(int));
+	p += sizeof(int);
+	names = p;
+	for(i = 0; i < col_count; i++) {
+		int len;
+		memcpy(&len, p, sizeof(int));
+		p += sizeof(int) + len;
+	}
+	memcpy(&row_count, p, sizeof(int));
+	p += sizeof(int);
+
+	lua_createtable(L, row_count, 0);
+	for(j = 0; j < row_count; j++) {
+		const unsigned char* name = names;
+		lua_createtable(L, mode == 1 ? col_count : 0, mode == 0 ? col_count : 0);
+		for(i = 0; i < col_count; i++) {
+			int len;
+			if(mode == 0) {
+				memcpy(&len, name, sizeof(int));
+				lua_pushlstring(L, (const char*)name + sizeof(int), len);
+				name += sizeof(int) + len;
+			} else {
+				lua_pushinteger(L, i + 1);
+			}
+			switch(*p++) {
+			case ENC_INTEGER: {
+					sqlite3_int64 v;
+					memcpy(&v, p, sizeof(v));
+					p += sizeof(v);
+					lua_pushinteger(L, v);
+					break;
+				}
+			case ENC_FLOAT: {
+					double v;
+					memcpy(&v, p, sizeof(v));
+					p += sizeof(v);
+					lua_pushnumber(L, v);
+					break;
+				}
+			case ENC_TEXT:
+				memcpy(&len, p, sizeof(int));
+				lua_pushlstring(L, (const char*)p + sizeof(int), len);
+				p += sizeof(int) + len;
+				break;
+			case ENC_NULL:
+			default:
+				lua_pushnil(L);
+				break;
+			}
+			lua_rawset(L, -3);
+		}
+		lua_rawseti(L, -2, j + 1);
 	}
-	return 0;
 }
 
-int lsqlite3lib_commit_callback(void* p) {
-	int ret = 0;
-	conn* c = (conn*)p;
-	lua_rawgeti(c->L, LUA_REGISTRYINDEX, c->ref);
-	lua_rawgeti(c->L, -1, IDX_CALLBACK_TABLE);
+static unsigned cache_hash(const unsigned char* key, size_t len) {
+	unsigned h = 5381;
+	while(len-- > 0) h = h * 33 + *key++;
+	return h;
+}
 
-	lua_pushinteger(c->L, IDX_FUNC_COMMIT_HOOK);
-	lua_rawget(c->L, -2); /* fnction */
-	lua_call(c->L, 0, 1);
-	ret = lua_tointeger(c->L, -1);
+static void cache_unlink(result_cache* rc, cache_entry* e) {
+	cache_entry** pp = &rc->buckets[e->hash % CACHE_BUCKETS];
+	while(*pp != e) pp = &(*pp)->hash_next;
+	*pp = e->hash_next;
 
-	lua_pop(c->L, 3);
-	return ret;
+	if(e->prev) e->prev->next = e->next; else rc->head = e->next;
+	if(e->next) e->next->prev = e->prev; else rc->tail = e->prev;
+
+	rc->bytes -= e->size;
+	rc->entries--;
+	sqlite3_free(e);
 }
 
-LUA_FUNC(connlib_set_commit_hook) {
-	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+static void cache_clear(result_cache* rc) {
+	if(rc->entries > 0) rc->invalidations++;
+	while(rc->head) cache_unlink(rc, rc->head);
+}
 
-	if(lua_gettop(L) > 1 && lua_isfunction(L, 2)) {
-		sqlite3_commit_hook(c->handle, lsqlite3lib_commit_callback, c);
+static void result_cache_free(result_cache* rc) {
+	cache_clear(rc);
+	sqlite3_finalize(rc->data_version);
+	sqlite3_free(rc);
+}
 
-		lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
-		lua_rawgeti(L, -1, IDX_CALLBACK_TABLE);
+static void cache_check_version(result_cache* rc, sqlite3* db) {
+	int version = -1;
 
-		lua_pushinteger(L, IDX_FUNC_COMMIT_HOOK);
-		lua_pushvalue(L, 2); /* push function */
-		lua_rawset(L, -3);
+	if(rc->data_version == NULL) {
+		sqlite3_prepare_v2(db, "PRAGMA data_version", -1, &rc->data_version, NULL);
+	}
+	if(rc->data_version && sqlite3_step(rc->data_version) == SQLITE_ROW) {
+		version = sqlite3_column_int(rc->data_version, 0);
+	}
+	if(rc->data_version) sqlite3_reset(rc->data_version);
+
+	if(version != rc->version || version == -1) {
+		cache_clear(rc);
+		rc->version = version;
+	}
+}
+
+static cache_entry* cache_lookup(result_cache* rc, const enc_buffer* key, unsigned hash) {
+	cache_entry* e;
+	for(e = rc->buckets[hash % CACHE_BUCKETS]; e; e = e->hash_next) {
+		if(e->hash == hash && e->key_len == key->n && memcmp(e->key, key->p, key->n) == 0) break;
+	}
+	if(e && e != rc->head) {
+		/* move to the front of the LRU list */
+		e->prev->next = e->next;
+		if(e->next) e->next->prev = e->prev; else rc->tail = e->prev;
+		e->prev = NULL;
+		e->next = rc->head;
+		rc->head->prev = e;
+		rc->head = e;
+	}
+	return e;
+}
+
+static void cache_insert(result_cache* rc, const enc_buffer* key, unsigned hash, const enc_buffer* b) {
+	size_t size = sizeof(cache_entry) + key->n + b->n;
+	cache_entry* e;
+
+	if(size > rc->budget) return;
+	while(rc->bytes + size > rc->budget) {
+		cache_unlink(rc, rc->tail);
+		rc->evictions++;
+	}
+	if((e = sqlite3_malloc64(size)) == NULL) return;
+
+	e->hash = hash;
+	e->size = size;
+	e->key = (unsigned char*)(e + 1);
+	e->key_len = key->n;
+	memcpy(e->key, key->p, key->n);
+	e->data = e->key + key->n;
+	e->data_len = b->n;
+	memcpy(e->data, b->p, b->n);
+
+	e->hash_next = rc->buckets[hash % CACHE_BUCKETS];
+	rc->buckets[hash % CACHE_BUCKETS] = e;
+	e->prev = NULL;
+	e->next = rc->head;
+	if(rc->head) rc->head->prev = e; else rc->tail = e;
+	rc->head = e;
+
+	rc->bytes += size;
+	rc->entries++;
+}
+
+static void install_transaction_hooks(lua_State* L, conn* c);
+
+/* c:set_result_cache(budget) enables the cache with a byte budget, nil or 0 disables it */
+LUA_FUNC(connlib_set_result_cache) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	lua_Integer budget = luaL_optinteger(L, 2, 0);
 
+	if(budget <= 0) {
+		if(c->cache) result_cache_free(c->cache);
+		c->cache = NULL;
 	} else {
-		sqlite3_commit_hook(c->handle, NULL, NULL);
+		if(c->cache == NULL) {
+			if((c->cache = sqlite3_malloc(sizeof(result_cache))) == NULL) {
+				return luaL_error(L, "out of memory");
+			}
+			memset(c->cache, 0, sizeof(result_cache));
+			c->cache->version = -1;
+		}
+		c->cache->budget = budget;
+		while(c->cache->bytes > c->cache->budget) {
+			cache_unlink(c->cache, c->cache->tail);
+			c->cache->evictions++;
+		}
 	}
+	install_transaction_hooks(L, c);
 	return 0;
 }
 
-void lsqlite3lib_trace_callback(void* p, const char* sql) {
+LUA_FUNC(connlib_result_cache_stats) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	result_cache* rc = c->cache;
+
+	if(rc == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_createtable(L, 0, 8);
+	lua_pushinteger(L, rc->hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, rc->misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushnumber(L, rc->hits + rc->misses > 0 ? (lua_Number)rc->hits / (rc->hits + rc->misses) : 0);
+	lua_setfield(L, -2, "hit_rate");
+	lua_pushinteger(L, rc->entries);
+	lua_setfield(L, -2, "entries");
+	lua_pushinteger(L, rc->bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushinteger(L, rc->budget);
+	lua_setfield(L, -2, "budget");
+	lua_pushinteger(L, rc->evictions);
+	lua_setfield(L, -2, "evictions");
+	lua_pushinteger(L, rc->invalidations);
+	lua_setfield(L, -2, "invalidations");
+	return 1;
+}
+
+void lsqlite3lib_rollback_callback(void* p) {
 	conn* c = (conn*)p;
 	lua_rawgeti(c->L, LUA_REGISTRYINDEX, c->ref);
 	lua_rawgeti(c->L, -1, IDX_CALLBACK_TABLE);
 
-	lua_pushinteger(c->L, IDX_FUNC_TRACE_CALLBACK);
+	lua_pushinteger(c->L, IDX_FUNC_ROLLBACK_HOOK);
 	lua_rawget(c->L, -2); /* fnction */
-	lua_pushstring(c->L, sql); /* arg */
-	lua_call(c->L, 1, 0);
-
+	if(lua_isfunction(c->L, -1)) {
+		lua_call(c->L, 0, 0);
+	} else {
+		lua_pop(c->L, 1);
+	}
 	lua_pop(c->L, 2);
+
+	c->n_changes = c->n_committed;
+	c->changes_overflow = 0;
 }
 
-LUA_FUNC(connlib_set_trace_callback) {
-	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
-	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
-	if(lua_gettop(L) > 1 && lua_isfunction(L, 2)) {
-		sqlite3_trace(c->handle, lsqlite3lib_trace_callback, c);
+/* pushes the committed changes and overflow flag, and drops them from the buffer */
+static void push_changes(lua_State* L, conn* c) {
+	static const char* const ops[] = {"insert", "update", "delete"};
+	int i;
 
-		lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
-		lua_rawgeti(L, -1, IDX_CALLBACK_TABLE);
+	lua_createtable(L, c->n_committed, 0);
+	for(i = 0; i < c->n_committed; i++) {
+		lua_createtable(L, 0, 3);
+		lua_pushstring(L, ops[c->changes[i].op]);
+		lua_setfield(L, -2, "op");
+		lua_pushstring(L, c->tables[c->changes[i].table]);
+		lua_setfield(L, -2, "table");
+		lua_pushinteger(L, c->changes[i].rowid);
+		lua_setfield(L, -2, "rowid");
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_pushboolean(L, c->committed_overflow);
 
-		lua_pushinteger(L, IDX_FUNC_TRACE_CALLBACK);
-		lua_pushvalue(L, 2); /* push function */
-		lua_rawset(L, -3);
+	c->n_changes -= c->n_committed;
+	memmove(c->changes, c->changes + c->n_committed, sizeof(change) * c->n_changes);
+	c->n_committed = 0;
+	c->committed_overflow = 0;
+}
 
+/*
+ * The commit hook only marks the recorded changes as committed: they are
+ * handed to the update hook function here, after the step or exec that
+ * committed has returned, so the function may use the connection and its
+ * errors don't unwind through SQLite.
+ */
+static void deliver_changes(lua_State* L, conn* c) {
+	if(c == NULL || (c->n_committed == 0 && !c->committed_overflow)) return;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+	lua_rawgeti(L, -1, IDX_CALLBACK_TABLE);
+	lua_rawgeti(L, -1, IDX_FUNC_UPDATE_HOOK);
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+	push_changes(L, c);
+	if(lua_isfunction(L, -3)) {
+		lua_call(L, 2, 0);
 	} else {
-		sqlite3_trace(c->handle, NULL, NULL);
+		lua_pop(L, 3);
 	}
-	return 0;
 }
 
-void lsqlite3lib_profile_callback(void* p,const char* sql,sqlite3_uint64 time) {
+int lsqlite3lib_commit_callback(void* p) {
+	int ret = 0;
 	conn* c = (conn*)p;
 	lua_rawgeti(c->L, LUA_REGISTRYINDEX, c->ref);
 	lua_rawgeti(c->L, -1, IDX_CALLBACK_TABLE);
 
-	lua_pushinteger(c->L, IDX_FUNC_PROFILE_CALLBACK);
+	lua_pushinteger(c->L, IDX_FUNC_COMMIT_HOOK);
 	lua_rawget(c->L, -2); /* fnction */
-	lua_pushstring(c->L, sql); /* arg1 */
-	lua_pushunsigned(c->L, time); /* arg2 */
-	lua_call(c->L, 2, 0);
+	if(lua_isfunction(c->L, -1)) {
+		lua_call(c->L, 0, 1);
+		ret = lua_tointeger(c->L, -1);
+	}
+	lua_pop(c->L, 1);
+
+	if(c->cache) cache_clear(c->cache);
+
+	/* a vetoed commit turns into a rollback, which discards the changes */
+	if(ret == 0 && c->update_hook) {
+		c->n_committed = c->n_changes;
+		c->committed_overflow |= c->changes_overflow;
+		c->changes_overflow = 0;
+	}
 
 	lua_pop(c->L, 2);
+	return ret;
 }
-LUA_FUNC(connlib_set_profile_callback) {
+
+/* the transaction hooks are shared by the Lua hooks and the update hook buffer */
+static void install_transaction_hooks(lua_State* L, conn* c) {
+	int commit, rollback;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+	lua_rawgeti(L, -1, IDX_CALLBACK_TABLE);
+	lua_rawgeti(L, -1, IDX_FUNC_COMMIT_HOOK);
+	commit = c->update_hook || c->cache || lua_isfunction(L, -1);
+	lua_rawgeti(L, -2, IDX_FUNC_ROLLBACK_HOOK);
+	rollback = c->update_hook || lua_isfunction(L, -1);
+	lua_pop(L, 4);
+
+	if(commit) {
+		sqlite3_commit_hook(c->handle, lsqlite3lib_commit_callback, c);
+	} else {
+		sqlite3_commit_hook(c->handle, NULL, NULL);
+	}
+	if(rollback) {
+		sqlite3_rollback_hook(c->handle, lsqlite3lib_rollback_callback, c);
+	} else {
+		sqlite3_rollback_hook(c->handle, NULL, NULL);
+	}
+}
+
+LUA_FUNC(connlib_set_rollback_hook) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	int has_function = lua_gettop(L) > 1 && lua_isfunction(L, 2);
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+	lua_rawgeti(L, -1, IDX_CALLBACK_TABLE);
+
+	lua_pushinteger(L, IDX_FUNC_ROLLBACK_HOOK);
+	if(has_function) {
+		lua_pushvalue(L, 2); /* push function */
+	} else {
+		lua_pushnil(L);
+	}
+	lua_rawset(L, -3);
+
+	install_transaction_hooks(L, c);
+	return 0;
+}
+
+LUA_FUNC(connlib_set_commit_hook) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	int has_function = lua_gettop(L) > 1 && lua_isfunction(L, 2);
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+	lua_rawgeti(L, -1, IDX_CALLBACK_TABLE);
+
+	lua_pushinteger(L, IDX_FUNC_COMMIT_HOOK);
+	if(has_function) {
+		lua_pushvalue(L, 2); /* push function */
+	} else {
+		lua_pushnil(L);
+	}
+	lua_rawset(L, -3);
+
+	install_transaction_hooks(L, c);
+	return 0;
+}
+
+static int intern_table(conn* c, const char* table) {
+	int i;
+	char** tables;
+
+	if(c->last_table < c->n_tables && strcmp(c->tables[c->last_table], table) == 0) {
+		return c->last_table;
+	}
+	for(i = 0; i < c->n_tables; i++) {
+		if(strcmp(c->tables[i], table) == 0) return c->last_table = i;
+	}
+	if((tables = sqlite3_realloc(c->tables, sizeof(char*) * (c->n_tables + 1))) == NULL) return -1;
+	c->tables = tables;
+	if((tables[c->n_tables] = sqlite3_mprintf("%s", table)) == NULL) return -1;
+	return c->last_table = c->n_tables++;
+}
+
+void lsqlite3lib_update_callback(void* p, int op, const char* db, const char* table, sqlite3_int64 rowid) {
+	conn* c = (conn*)p;
+	change* ch;
+
+	if(c->changes_overflow) return;
+	if(c->n_changes >= c->max_changes) {
+		c->changes_overflow = 1;
+		return;
+	}
+	if(c->n_changes == c->cap_changes) {
+		int cap = c->cap_changes ? c->cap_changes * 2 : 64;
+		if(cap > c->max_changes) cap = c->max_changes;
+		if((ch = sqlite3_realloc(c->changes, sizeof(change) * cap)) == NULL) {
+			c->changes_overflow = 1;
+			return;
+		}
+		c->changes = ch;
+		c->cap_changes = cap;
+	}
+
+	ch = &c->changes[c->n_changes];
+	ch->op = op == SQLITE_INSERT ? 0 : (op == SQLITE_UPDATE ? 1 : 2);
+	ch->rowid = rowid;
+	if((ch->table = intern_table(c, table)) < 0) {
+		c->changes_overflow = 1;
+		return;
+	}
+	c->n_changes++;
+}
+
+/*
+ * c:set_update_hook(fn, max) records {op, table, rowid} for every row change
+ * in a C buffer; a rollback discards the changes of its transaction. Once
+ * the step or exec that committed returns, fn(changes, overflow) gets the
+ * changes of the transactions it committed. After max (100000) buffered
+ * changes recording stops and overflow is true, meaning anything may have
+ * changed. SQLite has no hook for ROLLBACK TO, so changes undone by rolling
+ * back to a savepoint are still reported; only flush_writes, which knows
+ * where its savepoints start, drops them.
+ */
+LUA_FUNC(connlib_set_update_hook) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	int has_function = lua_gettop(L) > 1 && lua_isfunction(L, 2);
+	int max_changes = luaL_optint(L, 3, 100000);
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+	lua_rawgeti(L, -1, IDX_CALLBACK_TABLE);
+
+	lua_pushinteger(L, IDX_FUNC_UPDATE_HOOK);
+	if(has_function) {
+		c->update_hook = 1;
+		c->max_changes = max_changes;
+		sqlite3_update_hook(c->handle, lsqlite3lib_update_callback, c);
+		lua_pushvalue(L, 2); /* push function */
+	} else {
+		c->update_hook = 0;
+		sqlite3_update_hook(c->handle, NULL, NULL);
+		lua_pushnil(L);
+	}
+	lua_rawset(L, -3);
+
+	c->n_changes = c->n_committed = 0;
+	c->changes_overflow = c->committed_overflow = 0;
+	install_transaction_hooks(L, c);
+	return 0;
+}
+
+void lsqlite3lib_trace_callback(void* p, const char* sql) {
+	conn* c = (conn*)p;
+	lua_rawgeti(c->L, LUA_REGISTRYINDEX, c->ref);
+	lua_rawgeti(c->L, -1, IDX_CALLBACK_TABLE);
+
+	lua_pushinteger(c->L, IDX_FUNC_TRACE_CALLBACK);
+	lua_rawget(c->L, -2); /* fnction */
+	lua_pushstring(c->L, sql); /* arg */
+	lua_call(c->L, 1, 0);
+
+	lua_pop(c->L, 2);
+}
+
+LUA_FUNC(connlib_set_trace_callback) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+	if(lua_gettop(L) > 1 && lua_isfunction(L, 2)) {
+		sqlite3_trace(c->handle, lsqlite3lib_trace_callback, c);
+
+		lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+		lua_rawgeti(L, -1, IDX_CALLBACK_TABLE);
+
+		lua_pushinteger(L, IDX_FUNC_TRACE_CALLBACK);
+		lua_pushvalue(L, 2); /* push function */
+		lua_rawset(L, -3);
+
+	} else {
+		sqlite3_trace(c->handle, NULL, NULL);
+	}
+	return 0;
+}
+
+void lsqlite3lib_profile_callback(void* p,const char* sql,sqlite3_uint64 time) {
+	conn* c = (conn*)p;
+	lua_rawgeti(c->L, LUA_REGISTRYINDEX, c->ref);
+	lua_rawgeti(c->L, -1, IDX_CALLBACK_TABLE);
+
+	lua_pushinteger(c->L, IDX_FUNC_PROFILE_CALLBACK);
+	lua_rawget(c->L, -2); /* fnction */
+	lua_pushstring(c->L, sql); /* arg1 */
+	lua_pushunsigned(c->L, time); /* arg2 */
+	lua_call(c->L, 2, 0);
+
+	lua_pop(c->L, 2);
+}
+LUA_FUNC(connlib_set_profile_callback) {
 	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
 	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
 	if(lua_gettop(L) > 1 && lua_isfunction(L, 2)) {
@@ -361,6 +1252,48 @@ LUA_FUNC(connlib_set_profile_callback) {
 	return 0;
 }
 
+int lsqlite3lib_wal_callback(void* p, sqlite3* db, const char* schema, int pages) {
+	conn* c = (conn*)p;
+	lua_rawgeti(c->L, LUA_REGISTRYINDEX, c->ref);
+	lua_rawgeti(c->L, -1, IDX_CALLBACK_TABLE);
+
+	lua_pushinteger(c->L, IDX_FUNC_WAL_HOOK);
+	lua_rawget(c->L, -2); /* fnction */
+	lua_pushstring(c->L, schema); /* arg1 */
+	lua_pushinteger(c->L, pages); /* arg2 */
+	if(lua_pcall(c->L, 2, 0, 0) != LUA_OK) keep_hook_error(c);
+
+	lua_pop(c->L, 2);
+	return SQLITE_OK;
+}
+
+/*
+ * c:set_wal_hook(fn) calls fn(schema, pages) after every commit to a WAL
+ * database and turns off automatic checkpoints, which would otherwise run
+ * inside whichever commit crosses the threshold; checkpoint from idle time
+ * instead, see c:maintenance(). nil restores checkpoints every 1000 pages.
+ * fn runs inside the commit: an error it raises is raised once the
+ * committing call returns, and the commit stands.
+ */
+LUA_FUNC(connlib_set_wal_hook) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	int has_function = lua_gettop(L) > 1 && lua_isfunction(L, 2);
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+	lua_rawgeti(L, -1, IDX_CALLBACK_TABLE);
+
+	lua_pushinteger(L, IDX_FUNC_WAL_HOOK);
+	if(has_function) {
+		sqlite3_wal_hook(c->handle, lsqlite3lib_wal_callback, c);
+		lua_pushvalue(L, 2); /* push function */
+	} else {
+		sqlite3_wal_autocheckpoint(c->handle, 1000);
+		lua_pushnil(L);
+	}
+	lua_rawset(L, -3);
+	return 0;
+}
+
 void lsqlite3lib_xfunc_callback(sqlite3_context* ctx,int n, sqlite3_value** value) {
 	int i;
 	func* f = (func*)sqlite3_user_data(ctx);
@@ -434,6 +1367,8 @@ LUA_FUNC(connlib_set_function) {
 	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
 	const char* func_name = luaL_checkstring(L, 2);
 
+	if(c->cache) cache_clear(c->cache); /* cached results may have used the old definition */
+
 	if(lua_gettop(L) < 4 || lua_isnil(L, 3) || lua_isnil(L, 4)) {
 		sqlite3_create_function_v2(c->handle,
 				func_name,
@@ -584,6 +1519,8 @@ LUA_FUNC(connlib_set_aggregate) {
 	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
 	const char* func_name = luaL_checkstring(L, 2);
 
+	if(c->cache) cache_clear(c->cache);
+
 	if(lua_gettop(L) < 5 || (lua_isnil(L, 4) && lua_isnil(L, 5))) {
 		sqlite3_create_function_v2(c->handle,
 				func_name,
@@ -636,80 +1573,1738 @@ LUA_FUNC(connlib_set_aggregate) {
 	return 0;
 }
 
+int lsqlite3lib_collation_callback(void* p, int n1, const void* s1, int n2, const void* s2) {
+	func* f = (func*)p;
+	conn* c = f->c;
+	lua_Number ret;
 
-LUA_FUNC(connlib_tostring) {
-	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
-	if (!c->handle)
-		lua_pushfstring(L, "%s (closed)", MT_CONN);
-	else
-		lua_pushfstring(L, "%s (%p)", MT_CONN, c->handle);
-	return 1;
+	/* the sort can't be stopped, skip the function once it failed */
+	if(c->hook_error) return 0;
+
+	lua_rawgeti(c->L, LUA_REGISTRYINDEX, c->ref);
+	lua_rawgeti(c->L, -1, IDX_COLLATION_TABLE);
+
+	lua_pushstring(c->L, f->func_name);
+	lua_rawget(c->L, -2); /* fnction */
+	lua_pushlstring(c->L, (const char*)s1, n1);
+	lua_pushlstring(c->L, (const char*)s2, n2);
+	if(lua_pcall(c->L, 2, 1, 0) != LUA_OK) {
+		keep_hook_error(c);
+		lua_pop(c->L, 2);
+		return 0;
+	}
+	if(!lua_isnumber(c->L, -1)) {
+		lua_pop(c->L, 3);
+		lua_pushfstring(c->L, "collation %s must return a number", f->func_name);
+		keep_hook_error(c);
+		return 0;
+	}
+	ret = lua_tonumber(c->L, -1);
+
+	lua_pop(c->L, 3);
+	return ret < 0 ? -1 : (ret > 0 ? 1 : 0);
 }
 
-static const luaL_Reg connlib[] = {
-	{"close", connlib_close},
+LUA_FUNC(connlib_set_collation) {
+	func* f;
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	const char* collation_name = luaL_checkstring(L, 2);
 
-	{"prepare", connlib_prepare},
-	{"exec", connlib_exec},
-	{"run_script", connlib_run_script},
+	if(c->cache) cache_clear(c->cache);
 
-	{"begin", connlib_begin},
-	{"commit", connlib_commit},
-	{"rollback", connlib_rollback},
-	{"in_transaction", connlib_in_transaction},
+	if(lua_gettop(L) < 3 || lua_isnil(L, 3)) {
+		sqlite3_create_collation_v2(c->handle,
+				collation_name,
+				SQLITE_UTF8,
+				NULL,
+				NULL,
+				NULL
+		);
+	} else {
+		luaL_checktype(L, 3, LUA_TFUNCTION);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+		lua_rawgeti(L, -1, IDX_COLLATION_TABLE);
 
-	{"set_rollback_hook", connlib_set_rollback_hook},
-	{"set_commit_hook", connlib_set_commit_hook},
-	{"set_trace_callback", connlib_set_trace_callback},
-	{"set_profile_callback", connlib_set_profile_callback},
+		lua_pushstring(L, collation_name);
+		lua_pushvalue(L, 3);
+		lua_rawset(L, -3);
 
-	{"set_function", connlib_set_function},
-	{"set_aggregate", connlib_set_aggregate},
+		f = sqlite3_malloc(sizeof(func));
+		f->c = c;
+		f->func_name = sqlite3_malloc(strlen(collation_name) + 1);
+		strcpy(f->func_name, collation_name);
 
-	{"__gc", connlib_close},
-	{"__tostring", connlib_tostring},
+		sqlite3_create_collation_v2(c->handle,
+				collation_name,
+				SQLITE_UTF8,
+				f,
+				lsqlite3lib_collation_callback,
+				destroy_struct_func
+		);
+	}
+	return 0;
+}
 
-	{NULL, NULL}
-};
+static void push_value(lua_State* L, sqlite3_value* v) {
+	switch(sqlite3_value_type(v)) {
+	case SQLITE_INTEGER:
+		lua_pushinteger(L, sqlite3_value_int64(v));
+		break;
+	case SQLITE_FLOAT:
+		lua_pushnumber(L, sqlite3_value_double(v));
+		break;
+	case SQLITE_TEXT:
+	case SQLITE_BLOB:
+		lua_pushlstring(L, (const char*)sqlite3_value_blob(v), sqlite3_value_bytes(v));
+		break;
+	case SQLITE_NULL:
+	default:
+		lua_pushnil(L);
+		break;
+	}
+}
 
-LUA_FUNC(stmtlib_sql) {
-	stmt* s = (stmt*)luaL_checkudata(L, 1, MT_STMT);
-	lua_pushstring(L, sqlite3_sql(s->handle));
+static void result_value(sqlite3_context* ctx, lua_State* L, int idx) {
+	switch(lua_type(L, idx)) {
+	case LUA_TBOOLEAN:
+		sqlite3_result_int(ctx, lua_toboolean(L, idx));
+		break;
+	case LUA_TNUMBER: {
+			lua_Number n = lua_tonumber(L, idx);
+			if(n >= -9223372036854775808.0 && n < 9223372036854775808.0
+					&& n == (lua_Number)(sqlite3_int64)n) {
+				sqlite3_result_int64(ctx, (sqlite3_int64)n);
+			} else {
+				sqlite3_result_double(ctx, n);
+			}
+			break;
+		}
+	case LUA_TSTRING: {
+			size_t len;
+			const char* str = lua_tolstring(L, idx, &len);
+			sqlite3_result_text(ctx, str, len, SQLITE_TRANSIENT);
+			break;
+		}
+	case LUA_TNIL:
+	default:
+		sqlite3_result_null(ctx);
+		break;
+	}
+}
+
+/* push obj[name] and obj (as self); returns 0 and pushes nothing if it is not a function */
+static int push_method(lua_State* L, int ref, const char* name) {
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+	lua_getfield(L, -1, name);
+	if(!lua_isfunction(L, -1)) {
+		lua_pop(L, 2);
+		return 0;
+	}
+	lua_insert(L, -2);
 	return 1;
 }
 
-LUA_FUNC(stmtlib_reset) {
-	stmt* s = (stmt*)luaL_checkudata(L, 1, MT_STMT);
-	sqlite3_reset(s->handle);
-	return 0;
+static int vtab_error(sqlite3_vtab* base, lua_State* L) {
+	sqlite3_free(base->zErrMsg);
+	base->zErrMsg = sqlite3_mprintf("%s", lua_tostring(L, -1));
+	lua_pop(L, 1);
+	return SQLITE_ERROR;
 }
 
-LUA_FUNC(stmtlib_bind) {
-	int i;
-	int param_count;
-	stmt* s = (stmt*)luaL_checkudata(L, 1, MT_STMT);
+static int lsqlite3lib_vtab_connect(sqlite3* db, void* p, int argc,
+		const char* const* argv, sqlite3_vtab** out, char** err) {
+	func* m = (func*)p;
+	lua_State* L = m->c->L;
+	int top = lua_gettop(L);
+	int i, ret;
+	vtab* vt;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m->c->ref);
+	lua_rawgeti(L, -1, IDX_MODULE_TABLE);
+	lua_pushstring(L, m->func_name);
+	lua_rawget(L, -2); /* impl */
+
+	lua_getfield(L, -1, "schema");
+	if(lua_isfunction(L, -1)) {
+		lua_pushvalue(L, -2);
+		lua_pushstring(L, argv[2]); /* table name */
+		lua_createtable(L, argc - 3, 0);
+		for(i = 3; i < argc; i++) {
+			lua_pushstring(L, argv[i]);
+			lua_rawseti(L, -2, i - 2);
+		}
+		if(lua_pcall(L, 3, 1, 0) != LUA_OK) {
+			*err = sqlite3_mprintf("%s", lua_tostring(L, -1));
+			lua_settop(L, top);
+			return SQLITE_ERROR;
+		}
+	}
+	if(!lua_isstring(L, -1)) {
+		*err = sqlite3_mprintf("module %s: schema must be a string", m->func_name);
+		lua_settop(L, top);
+		return SQLITE_ERROR;
+	}
+	if((ret = sqlite3_declare_vtab(db, lua_tostring(L, -1))) != SQLITE_OK) {
+		*err = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+		lua_settop(L, top);
+		return ret;
+	}
+	lua_pop(L, 1);
 
-	if(!lua_istable(L, 2)) {
-		char msg[256];
-		sprintf(msg, "table expected, got %s", lua_typename(L, 2));
-		return luaL_argerror(L, 2, msg);
+	if((vt = sqlite3_malloc(sizeof(vtab))) == NULL) {
+		lua_settop(L, top);
+		return SQLITE_NOMEM;
 	}
+	memset(vt, 0, sizeof(vtab));
+	vt->c = m->c;
+	vt->ref = luaL_ref(L, LUA_REGISTRYINDEX); /* pops impl */
+	*out = &vt->base;
 
-	sqlite3_reset(s->handle);
-	sqlite3_clear_bindings(s->handle);
-	param_count = sqlite3_bind_parameter_count(s->handle);
+	lua_settop(L, top);
+	return SQLITE_OK;
+}
 
-	lua_pushnil(L);
-	while (lua_next(L, 2) != 0) {
-		int index = 0;
-		const char* str;
+static int lsqlite3lib_vtab_disconnect(sqlite3_vtab* base) {
+	vtab* vt = (vtab*)base;
+	luaL_unref(vt->c->L, LUA_REGISTRYINDEX, vt->ref);
+	sqlite3_free(vt);
+	return SQLITE_OK;
+}
 
-		if(lua_isnumber(L, -2)) {
-			index = lua_tointeger(L, -2);
-		} else if(lua_isstring(L, -2)) {
-			str = lua_tostring(L, -2);
-			if(*str == ':' || *str == '@' || *str == '$') {
-				index = sqlite3_bind_parameter_index(s->handle, str);
+static const char* constraint_op(unsigned char op) {
+	switch(op) {
+	case SQLITE_INDEX_CONSTRAINT_EQ: return "=";
+	case SQLITE_INDEX_CONSTRAINT_GT: return ">";
+	case SQLITE_INDEX_CONSTRAINT_LE: return "<=";
+	case SQLITE_INDEX_CONSTRAINT_LT: return "<";
+	case SQLITE_INDEX_CONSTRAINT_GE: return ">=";
+	case SQLITE_INDEX_CONSTRAINT_MATCH: return "match";
+#ifdef SQLITE_INDEX_CONSTRAINT_LIKE
+	case SQLITE_INDEX_CONSTRAINT_LIKE: return "like";
+	case SQLITE_INDEX_CONSTRAINT_GLOB: return "glob";
+	case SQLITE_INDEX_CONSTRAINT_REGEXP: return "regexp";
+#endif
+#ifdef SQLITE_INDEX_CONSTRAINT_NE
+	case SQLITE_INDEX_CONSTRAINT_NE: return "!=";
+	case SQLITE_INDEX_CONSTRAINT_ISNOT: return "is not";
+	case SQLITE_INDEX_CONSTRAINT_ISNOTNULL: return "is not null";
+	case SQLITE_INDEX_CONSTRAINT_ISNULL: return "is null";
+	case SQLITE_INDEX_CONSTRAINT_IS: return "is";
+#endif
+#ifdef SQLITE_INDEX_CONSTRAINT_LIMIT
+	case SQLITE_INDEX_CONSTRAINT_LIMIT: return "limit";
+	case SQLITE_INDEX_CONSTRAINT_OFFSET: return "offset";
+#endif
+	default: return "function";
+	}
+}
+
+/*
+ * impl:best_index(info) receives
+ *   info.constraints = { {column = n, op = "=", usable = bool}, ... }
+ *   info.order_by    = { {column = n, desc = bool}, ... }
+ * (columns are 1-based, 0 is the rowid) and may set
+ *   constraint.argv_index, constraint.omit, info.idx_num, info.idx_str,
+ *   info.order_by_consumed, info.estimated_cost, info.estimated_rows, info.unique
+ */
+static int lsqlite3lib_vtab_best_index(sqlite3_vtab* base, sqlite3_index_info* info) {
+	vtab* vt = (vtab*)base;
+	lua_State* L = vt->c->L;
+	int top = lua_gettop(L);
+	int i;
+
+	if(!push_method(L, vt->ref, "best_index")) {
+		info->estimatedCost = 1000000;
+		return SQLITE_OK;
+	}
+
+	lua_createtable(L, 0, 2);
+	lua_createtable(L, info->nConstraint, 0);
+	for(i = 0; i < info->nConstraint; i++) {
+		lua_createtable(L, 0, 3);
+		lua_pushinteger(L, info->aConstraint[i].iColumn + 1);
+		lua_setfield(L, -2, "column");
+		lua_pushstring(L, constraint_op(info->aConstraint[i].op));
+		lua_setfield(L, -2, "op");
+		lua_pushboolean(L, info->aConstraint[i].usable);
+		lua_setfield(L, -2, "usable");
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "constraints");
+
+	lua_createtable(L, info->nOrderBy, 0);
+	for(i = 0; i < info->nOrderBy; i++) {
+		lua_createtable(L, 0, 2);
+		lua_pushinteger(L, info->aOrderBy[i].iColumn + 1);
+		lua_setfield(L, -2, "column");
+		lua_pushboolean(L, info->aOrderBy[i].desc);
+		lua_setfield(L, -2, "desc");
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "order_by");
+
+	lua_pushvalue(L, -1);
+	lua_insert(L, top + 1); /* keep info below the call */
+	if(lua_pcall(L, 2, 0, 0) != LUA_OK) {
+		int ret = vtab_error(base, L);
+		lua_settop(L, top);
+		return ret;
+	}
+
+	lua_getfield(L, top + 1, "constraints");
+	for(i = 0; i < info->nConstraint; i++) {
+		lua_rawgeti(L, -1, i + 1);
+		lua_getfield(L, -1, "argv_index");
+		info->aConstraintUsage[i].argvIndex = lua_tointeger(L, -1);
+		lua_getfield(L, -2, "omit");
+		info->aConstraintUsage[i].omit = lua_toboolean(L, -1);
+		lua_pop(L, 3);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, top + 1, "idx_num");
+	info->idxNum = lua_tointeger(L, -1);
+	lua_getfield(L, top + 1, "idx_str");
+	if(lua_isstring(L, -1)) {
+		info->idxStr = sqlite3_mprintf("%s", lua_tostring(L, -1));
+		info->needToFreeIdxStr = 1;
+	}
+	lua_getfield(L, top + 1, "order_by_consumed");
+	info->orderByConsumed = lua_toboolean(L, -1);
+	lua_getfield(L, top + 1, "estimated_cost");
+	info->estimatedCost = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : 1000000;
+	lua_getfield(L, top + 1, "estimated_rows");
+	if(lua_isnumber(L, -1)) info->estimatedRows = (sqlite3_int64)lua_tonumber(L, -1);
+	lua_getfield(L, top + 1, "unique");
+	if(lua_toboolean(L, -1)) info->idxFlags |= SQLITE_INDEX_SCAN_UNIQUE;
+
+	lua_settop(L, top);
+	return SQLITE_OK;
+}
+
+static int lsqlite3lib_vtab_open(sqlite3_vtab* base, sqlite3_vtab_cursor** out) {
+	vtab* vt = (vtab*)base;
+	lua_State* L = vt->c->L;
+	cursor* cur;
+
+	if(!push_method(L, vt->ref, "open")) {
+		sqlite3_free(base->zErrMsg);
+		base->zErrMsg = sqlite3_mprintf("module has no open method");
+		return SQLITE_ERROR;
+	}
+	if(lua_pcall(L, 1, 1, 0) != LUA_OK) return vtab_error(base, L);
+
+	if((cur = sqlite3_malloc(sizeof(cursor))) == NULL) {
+		lua_pop(L, 1);
+		return SQLITE_NOMEM;
+	}
+	memset(cur, 0, sizeof(cursor));
+	cur->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	cur->eof = 1;
+	*out = &cur->base;
+	return SQLITE_OK;
+}
+
+static int lsqlite3lib_vtab_close(sqlite3_vtab_cursor* base) {
+	cursor* cur = (cursor*)base;
+	vtab* vt = (vtab*)base->pVtab;
+	lua_State* L = vt->c->L;
+
+	if(push_method(L, cur->ref, "close")) {
+		if(lua_pcall(L, 1, 0, 0) != LUA_OK) lua_pop(L, 1);
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, cur->ref);
+	sqlite3_free(cur);
+	return SQLITE_OK;
+}
+
+/* eof is evaluated once per row here so that xEof never enters Lua */
+static int cursor_update_eof(cursor* cur, lua_State* L) {
+	if(!push_method(L, cur->ref, "eof")) {
+		lua_pushstring(L, "cursor has no eof method");
+		return vtab_error(cur->base.pVtab, L);
+	}
+	if(lua_pcall(L, 1, 1, 0) != LUA_OK) return vtab_error(cur->base.pVtab, L);
+	cur->eof = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	return SQLITE_OK;
+}
+
+static int lsqlite3lib_vtab_filter(sqlite3_vtab_cursor* base, int idx_num,
+		const char* idx_str, int argc, sqlite3_value** argv) {
+	cursor* cur = (cursor*)base;
+	lua_State* L = ((vtab*)base->pVtab)->c->L;
+	int i;
+
+	if(!push_method(L, cur->ref, "filter")) {
+		lua_pushstring(L, "cursor has no filter method");
+		return vtab_error(base->pVtab, L);
+	}
+	lua_pushinteger(L, idx_num);
+	if(idx_str) {
+		lua_pushstring(L, idx_str);
+	} else {
+		lua_pushnil(L);
+	}
+	lua_createtable(L, argc, 0);
+	for(i = 0; i < argc; i++) {
+		push_value(L, argv[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	if(lua_pcall(L, 4, 0, 0) != LUA_OK) return vtab_error(base->pVtab, L);
+
+	cur->rowid = 1;
+	return cursor_update_eof(cur, L);
+}
+
+static int lsqlite3lib_vtab_next(sqlite3_vtab_cursor* base) {
+	cursor* cur = (cursor*)base;
+	lua_State* L = ((vtab*)base->pVtab)->c->L;
+
+	if(!push_method(L, cur->ref, "next")) {
+		lua_pushstring(L, "cursor has no next method");
+		return vtab_error(base->pVtab, L);
+	}
+	if(lua_pcall(L, 1, 0, 0) != LUA_OK) return vtab_error(base->pVtab, L);
+
+	cur->rowid++;
+	return cursor_update_eof(cur, L);
+}
+
+static int lsqlite3lib_vtab_eof(sqlite3_vtab_cursor* base) {
+	return ((cursor*)base)->eof;
+}
+
+static int lsqlite3lib_vtab_column(sqlite3_vtab_cursor* base, sqlite3_context* ctx, int i) {
+	cursor* cur = (cursor*)base;
+	lua_State* L = ((vtab*)base->pVtab)->c->L;
+
+	if(!push_method(L, cur->ref, "column")) {
+		sqlite3_result_error(ctx, "cursor has no column method", -1);
+		return SQLITE_ERROR;
+	}
+	lua_pushinteger(L, i + 1);
+	if(lua_pcall(L, 2, 1, 0) != LUA_OK) {
+		sqlite3_result_error(ctx, lua_tostring(L, -1), -1);
+		lua_pop(L, 1);
+		return SQLITE_ERROR;
+	}
+	result_value(ctx, L, -1);
+	lua_pop(L, 1);
+	return SQLITE_OK;
+}
+
+/* without a rowid method the row number within the current scan is used */
+static int lsqlite3lib_vtab_rowid(sqlite3_vtab_cursor* base, sqlite3_int64* rowid) {
+	cursor* cur = (cursor*)base;
+	lua_State* L = ((vtab*)base->pVtab)->c->L;
+
+	if(!push_method(L, cur->ref, "rowid")) {
+		*rowid = cur->rowid;
+		return SQLITE_OK;
+	}
+	if(lua_pcall(L, 1, 1, 0) != LUA_OK) return vtab_error(base->pVtab, L);
+	*rowid = (sqlite3_int64)lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	return SQLITE_OK;
+}
+
+static sqlite3_module lsqlite3lib_module = {
+	0,                               /* iVersion */
+	lsqlite3lib_vtab_connect,        /* xCreate (same as xConnect: eponymous) */
+	lsqlite3lib_vtab_connect,        /* xConnect */
+	lsqlite3lib_vtab_best_index,     /* xBestIndex */
+	lsqlite3lib_vtab_disconnect,     /* xDisconnect */
+	lsqlite3lib_vtab_disconnect,     /* xDestroy */
+	lsqlite3lib_vtab_open,           /* xOpen */
+	lsqlite3lib_vtab_close,          /* xClose */
+	lsqlite3lib_vtab_filter,         /* xFilter */
+	lsqlite3lib_vtab_next,           /* xNext */
+	lsqlite3lib_vtab_eof,            /* xEof */
+	lsqlite3lib_vtab_column,         /* xColumn */
+	lsqlite3lib_vtab_rowid,          /* xRowid */
+	NULL,                            /* xUpdate */
+	NULL,                            /* xBegin */
+	NULL,                            /* xSync */
+	NULL,                            /* xCommit */
+	NULL,                            /* xRollback */
+	NULL,                            /* xFindFunction */
+	NULL,                            /* xRename */
+	NULL,                            /* xSavepoint */
+	NULL,                            /* xRelease */
+	NULL,                            /* xRollbackTo */
+	NULL                             /* xShadowName */
+};
+
+/*
+ * c:create_module(name, impl) registers a virtual table module backed by impl:
+ *   impl.schema                 "CREATE TABLE x(...)", or function(impl, table_name, args)
+ *   impl:best_index(info)       optional, see lsqlite3lib_vtab_best_index
+ *   impl:open()                 returns a cursor object with the methods
+ *     cursor:filter(idx_num, idx_str, args), cursor:next(), cursor:eof(),
+ *     cursor:column(n) (1-based), and optionally cursor:rowid(), cursor:close()
+ * c:create_module(name) removes the module.
+ */
+LUA_FUNC(connlib_create_module) {
+	func* m;
+	int ret;
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	const char* module_name = luaL_checkstring(L, 2);
+
+	if(c->cache) cache_clear(c->cache);
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+	lua_rawgeti(L, -1, IDX_MODULE_TABLE);
+
+	if(lua_gettop(L) < 3 || lua_isnil(L, 3)) {
+		ret = sqlite3_create_module_v2(c->handle, module_name, NULL, NULL, NULL);
+		lua_pushstring(L, module_name);
+		lua_pushnil(L);
+		lua_rawset(L, -3);
+	} else {
+		luaL_checktype(L, 3, LUA_TTABLE);
+
+		lua_pushstring(L, module_name);
+		lua_pushvalue(L, 3);
+		lua_rawset(L, -3);
+
+		m = sqlite3_malloc(sizeof(func));
+		m->c = c;
+		m->func_name = sqlite3_malloc(strlen(module_name) + 1);
+		strcpy(m->func_name, module_name);
+
+		ret = sqlite3_create_module_v2(c->handle,
+				module_name,
+				&lsqlite3lib_module,
+				m,
+				destroy_struct_func
+		);
+	}
+	if(ret != SQLITE_OK) {
+		return luaL_error(L, "[%d] %s", ret, sqlite3_errmsg(c->handle));
+	}
+	return 0;
+}
+
+/*
+ * carray(?) table-valued function: a Lua array bound with stmt:bind is
+ * packed into a C buffer and handed to the statement with
+ * sqlite3_bind_pointer, so "WHERE id IN carray(:ids)" works for any size.
+ */
+#define ARRAY_POINTER_TYPE "lsqlite3lib:array"
+
+struct lsqlite3lib_array {
+	int type; /* SQLITE_INTEGER, SQLITE_FLOAT or SQLITE_TEXT */
+	int n;
+	sqlite3_int64* ints;
+	double* doubles;
+	const char** strs;
+	int* lens;
+};
+
+struct lsqlite3lib_array_cursor {
+	sqlite3_vtab_cursor base;
+	array* a;
+	int i;
+};
+
+/* packs the Lua array at idx; returns NULL with an error message pushed on failure */
+static array* array_pack(lua_State* L, int idx) {
+	int n = lua_rawlen(L, idx);
+	int type = SQLITE_INTEGER;
+	size_t bytes = 0;
+	int i;
+	array* a;
+	char* p;
+
+	for(i = 1; i <= n; i++) {
+		lua_rawgeti(L, idx, i);
+		if(lua_type(L, -1) == LUA_TNUMBER) {
+			lua_Number v = lua_tonumber(L, -1);
+			if(type == SQLITE_TEXT) break;
+			if(v != (lua_Number)(sqlite3_int64)v) type = SQLITE_FLOAT;
+		} else if(lua_type(L, -1) == LUA_TSTRING) {
+			size_t len;
+			lua_tolstring(L, -1, &len);
+			if(i > 1 && type != SQLITE_TEXT) break;
+			type = SQLITE_TEXT;
+			bytes += len + 1;
+		} else {
+			break;
+		}
+		lua_pop(L, 1);
+	}
+	if(i <= n) {
+		lua_pop(L, 1);
+		lua_pushfstring(L, "array element %d: all elements must be numbers or all strings", i);
+		return NULL;
+	}
+
+	switch(type) {
+	case SQLITE_INTEGER:
+		bytes = sizeof(sqlite3_int64) * n;
+		break;
+	case SQLITE_FLOAT:
+		bytes = sizeof(double) * n;
+		break;
+	case SQLITE_TEXT:
+		bytes += (sizeof(char*) + sizeof(int)) * n;
+		break;
+	}
+
+	if((a = sqlite3_malloc(sizeof(array) + bytes)) == NULL) {
+		lua_pushstring(L, "out of memory");
+		return NULL;
+	}
+	memset(a, 0, sizeof(array));
+	a->type = type;
+	a->n = n;
+	p = (char*)(a + 1);
+
+	switch(type) {
+	case SQLITE_INTEGER:
+		a->ints = (sqlite3_int64*)p;
+		for(i = 0; i < n; i++) {
+			lua_rawgeti(L, idx, i + 1);
+			a->ints[i] = (sqlite3_int64)lua_tonumber(L, -1);
+			lua_pop(L, 1);
+		}
+		break;
+	case SQLITE_FLOAT:
+		a->doubles = (double*)p;
+		for(i = 0; i < n; i++) {
+			lua_rawgeti(L, idx, i + 1);
+			a->doubles[i] = lua_tonumber(L, -1);
+			lua_pop(L, 1);
+		}
+		break;
+	case SQLITE_TEXT:
+		a->strs = (const char**)p;
+		a->lens = (int*)(p + sizeof(char*) * n);
+		p += (sizeof(char*) + sizeof(int)) * n;
+		for(i = 0; i < n; i++) {
+			size_t len;
+			const char* str;
+			lua_rawgeti(L, idx, i + 1);
+			str = lua_tolstring(L, -1, &len);
+			memcpy(p, str, len + 1);
+			a->strs[i] = p;
+			a->lens[i] = len;
+			p += len + 1;
+			lua_pop(L, 1);
+		}
+		break;
+	}
+	return a;
+}
+
+static int lsqlite3lib_carray_connect(sqlite3* db, void* p, int argc,
+		const char* const* argv, sqlite3_vtab** out, char** err) {
+	int ret = sqlite3_declare_vtab(db, "CREATE TABLE x(value, pointer HIDDEN)");
+	if(ret != SQLITE_OK) return ret;
+	if((*out = sqlite3_malloc(sizeof(sqlite3_vtab))) == NULL) return SQLITE_NOMEM;
+	memset(*out, 0, sizeof(sqlite3_vtab));
+	return SQLITE_OK;
+}
+
+static int lsqlite3lib_carray_disconnect(sqlite3_vtab* base) {
+	sqlite3_free(base);
+	return SQLITE_OK;
+}
+
+static int lsqlite3lib_carray_best_index(sqlite3_vtab* base, sqlite3_index_info* info) {
+	int i;
+	for(i = 0; i < info->nConstraint; i++) {
+		if(info->aConstraint[i].iColumn == 1
+				&& info->aConstraint[i].op == SQLITE_INDEX_CONSTRAINT_EQ
+				&& info->aConstraint[i].usable) {
+			info->aConstraintUsage[i].argvIndex = 1;
+			info->aConstraintUsage[i].omit = 1;
+			info->estimatedCost = 1;
+			info->estimatedRows = 100;
+			return SQLITE_OK;
+		}
+	}
+	/* without the pointer argument there is nothing to scan */
+	info->estimatedCost = 2147483647;
+	info->estimatedRows = 2147483647;
+	return SQLITE_OK;
+}
+
+static int lsqlite3lib_carray_open(sqlite3_vtab* base, sqlite3_vtab_cursor** out) {
+	array_cursor* cur = sqlite3_malloc(sizeof(array_cursor));
+	if(cur == NULL) return SQLITE_NOMEM;
+	memset(cur, 0, sizeof(array_cursor));
+	*out = &cur->base;
+	return SQLITE_OK;
+}
+
+static int lsqlite3lib_carray_close(sqlite3_vtab_cursor* base) {
+	sqlite3_free(base);
+	return SQLITE_OK;
+}
+
+static int lsqlite3lib_carray_filter(sqlite3_vtab_cursor* base, int idx_num,
+		const char* idx_str, int argc, sqlite3_value** argv) {
+	array_cursor* cur = (array_cursor*)base;
+	cur->a = argc > 0 ? sqlite3_value_pointer(argv[0], ARRAY_POINTER_TYPE) : NULL;
+	cur->i = 0;
+	return SQLITE_OK;
+}
+
+static int lsqlite3lib_carray_next(sqlite3_vtab_cursor* base) {
+	((array_cursor*)base)->i++;
+	return SQLITE_OK;
+}
+
+static int lsqlite3lib_carray_eof(sqlite3_vtab_cursor* base) {
+	array_cursor* cur = (array_cursor*)base;
+	return cur->a == NULL || cur->i >= cur->a->n;
+}
+
+static int lsqlite3lib_carray_column(sqlite3_vtab_cursor* base, sqlite3_context* ctx, int i) {
+	array_cursor* cur = (array_cursor*)base;
+	if(i != 0) return SQLITE_OK; /* pointer column reads as NULL */
+
+	switch(cur->a->type) {
+	case SQLITE_INTEGER:
+		sqlite3_result_int64(ctx, cur->a->ints[cur->i]);
+		break;
+	case SQLITE_FLOAT:
+		sqlite3_result_double(ctx, cur->a->doubles[cur->i]);
+		break;
+	case SQLITE_TEXT:
+		sqlite3_result_text(ctx, cur->a->strs[cur->i], cur->a->lens[cur->i], SQLITE_STATIC);
+		break;
+	}
+	return SQLITE_OK;
+}
+
+static int lsqlite3lib_carray_rowid(sqlite3_vtab_cursor* base, sqlite3_int64* rowid) {
+	*rowid = ((array_cursor*)base)->i + 1;
+	return SQLITE_OK;
+}
+
+static sqlite3_module lsqlite3lib_carray_module = {
+	0,                               /* iVersion */
+	NULL,                            /* xCreate (eponymous only) */
+	lsqlite3lib_carray_connect,      /* xConnect */
+	lsqlite3lib_carray_best_index,   /* xBestIndex */
+	lsqlite3lib_carray_disconnect,   /* xDisconnect */
+	lsqlite3lib_carray_disconnect,   /* xDestroy */
+	lsqlite3lib_carray_open,         /* xOpen */
+	lsqlite3lib_carray_close,        /* xClose */
+	lsqlite3lib_carray_filter,       /* xFilter */
+	lsqlite3lib_carray_next,         /* xNext */
+	lsqlite3lib_carray_eof,          /* xEof */
+	lsqlite3lib_carray_column,       /* xColumn */
+	lsqlite3lib_carray_rowid,        /* xRowid */
+	NULL,                            /* xUpdate */
+	NULL,                            /* xBegin */
+	NULL,                            /* xSync */
+	NULL,                            /* xCommit */
+	NULL,                            /* xRollback */
+	NULL,                            /* xFindFunction */
+	NULL,                            /* xRename */
+	NULL,                            /* xSavepoint */
+	NULL,                            /* xRelease */
+	NULL,                            /* xRollbackTo */
+	NULL                             /* xShadowName */
+};
+
+static const char* opt_string(lua_State* L, int idx, const char* key, const char* def) {
+	const char* ret = def;
+	if(!lua_istable(L, idx)) return def;
+	lua_getfield(L, idx, key);
+	if(lua_isstring(L, -1)) ret = lua_tostring(L, -1); /* still referenced by the table */
+	lua_pop(L, 1);
+	return ret;
+}
+
+static lua_Integer opt_integer(lua_State* L, int idx, const char* key, lua_Integer def) {
+	lua_Integer ret = def;
+	if(!lua_istable(L, idx)) return def;
+	lua_getfield(L, idx, key);
+	if(lua_isnumber(L, -1)) ret = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	return ret;
+}
+
+static int opt_boolean(lua_State* L, int idx, const char* key, int def) {
+	int ret = def;
+	if(!lua_istable(L, idx)) return def;
+	lua_getfield(L, idx, key);
+	if(!lua_isnil(L, -1)) ret = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	return ret;
+}
+
+#define CSV_BUFSIZE 65536
+
+typedef struct {
+	FILE* fp;
+	int delim;
+	int quote;
+	char special[256]; /* bytes that end an unquoted field */
+	size_t pos;
+	size_t len;
+	char* data; /* fields of the current record, each NUL terminated */
+	size_t data_len;
+	size_t data_cap;
+	size_t* offs;
+	int* lens;
+	int* quoted;
+	int n;
+	int cap;
+	char buf[CSV_BUFSIZE];
+} csv_reader;
+
+static int csv_fill(csv_reader* r) {
+	r->len = fread(r->buf, 1, CSV_BUFSIZE, r->fp);
+	r->pos = 0;
+	return r->len > 0;
+}
+
+#define CSV_GETC(r) \
+	((r)->pos < (r)->len || csv_fill(r) ? (unsigned char)(r)->buf[(r)->pos++] : EOF)
+
+static int csv_append(csv_reader* r, const char* p, size_t n) {
+	if(r->data_len + n > r->data_cap) {
+		size_t cap = r->data_cap ? r->data_cap : 256;
+		char* data;
+		while(r->data_len + n > cap) cap *= 2;
+		if((data = sqlite3_realloc(r->data, cap)) == NULL) return 0;
+		r->data = data;
+		r->data_cap = cap;
+	}
+	memcpy(r->data + r->data_len, p, n);
+	r->data_len += n;
+	return 1;
+}
+
+static int csv_addc(csv_reader* r, int c) {
+	char ch = (char)c;
+	return csv_append(r, &ch, 1);
+}
+
+static int csv_end_field(csv_reader* r, size_t start, int quoted) {
+	if(r->n == r->cap) {
+		int cap = r->cap ? r->cap * 2 : 16;
+		size_t* offs = sqlite3_realloc(r->offs, sizeof(size_t) * cap);
+		int* lens = offs ? sqlite3_realloc(r->lens, sizeof(int) * cap) : NULL;
+		int* q = lens ? sqlite3_realloc(r->quoted, sizeof(int) * cap) : NULL;
+		if(offs) r->offs = offs;
+		if(lens) r->lens = lens;
+		if(q == NULL) return 0;
+		r->quoted = q;
+		r->cap = cap;
+	}
+	r->offs[r->n] = start;
+	r->lens[r->n] = r->data_len - start;
+	r->quoted[r->n] = quoted;
+	r->n++;
+	return csv_append(r, "", 1);
+}
+
+/* reads one record; returns the number of fields, 0 at end of file, -1 when out of memory */
+static int csv_read_record(csv_reader* r) {
+	int c;
+
+	do {
+		r->n = 0;
+		r->data_len = 0;
+		if((c = CSV_GETC(r)) == EOF) return 0;
+
+		for(;;) {
+			size_t start = r->data_len;
+			int quoted = 0;
+
+			if(c == r->quote) {
+				quoted = 1;
+				for(;;) {
+					if((c = CSV_GETC(r)) == EOF) break;
+					if(c == r->quote) {
+						if((c = CSV_GETC(r)) != r->quote) break;
+					}
+					if(!csv_addc(r, c)) return -1;
+				}
+			}
+			/* unquoted data, or stray bytes after a closing quote */
+			while(c != EOF && !r->special[c]) {
+				size_t from = r->pos - 1;
+				while(r->pos < r->len && !r->special[(unsigned char)r->buf[r->pos]]) r->pos++;
+				if(!csv_append(r, r->buf + from, r->pos - from)) return -1;
+				c = CSV_GETC(r);
+			}
+			if(!csv_end_field(r, start, quoted)) return -1;
+
+			if(c == r->delim) {
+				c = CSV_GETC(r);
+				continue;
+			}
+			if(c == '\r') {
+				if((c = CSV_GETC(r)) != '\n' && c != EOF) r->pos--;
+			}
+			break;
+		}
+		/* skip blank lines */
+	} while(r->n == 1 && r->lens[0] == 0 && !r->quoted[0]);
+
+	return r->n;
+}
+
+static csv_reader* csv_open(const char* path, int delim, int quote) {
+	csv_reader* r;
+	FILE* fp;
+	if((fp = fopen(path, "rb")) == NULL) return NULL;
+	if((r = sqlite3_malloc(sizeof(csv_reader))) == NULL) {
+		fclose(fp);
+		return NULL;
+	}
+	memset(r, 0, sizeof(csv_reader));
+	r->fp = fp;
+	r->delim = delim;
+	r->quote = quote;
+	r->special[(unsigned char)delim] = 1;
+	r->special['\n'] = 1;
+	r->special['\r'] = 1;
+	return r;
+}
+
+static void csv_close(csv_reader* r) {
+	fclose(r->fp);
+	sqlite3_free(r->data);
+	sqlite3_free(r->offs);
+	sqlite3_free(r->lens);
+	sqlite3_free(r->quoted);
+	sqlite3_free(r);
+}
+
+/*
+ * binds an unquoted field as INTEGER or REAL when the whole text is a finite
+ * number; leading zeros ("00501") and inf/nan stay TEXT
+ */
+/* what detect_types makes of an unquoted, NUL-terminated field */
+static int csv_field_type(const char* str, int len, sqlite3_int64* iv, double* dv) {
+	const char* digits = str + (str[0] == '+' || str[0] == '-');
+	char* end;
+
+	if(len == 0 || !strchr("+-.0123456789", str[0])) return SQLITE_TEXT;
+	if(digits[0] == '0' && IS_DIGIT(digits[1])) return SQLITE_TEXT;
+
+	errno = 0;
+	*iv = strtoll(str, &end, 10);
+	if(end == str + len && errno == 0) return SQLITE_INTEGER;
+
+	errno = 0;
+	*dv = strtod(str, &end);
+	if(end == str + len && errno == 0 && *dv - *dv == 0 && !strpbrk(str, "xX")) {
+		return SQLITE_FLOAT;
+	}
+	return SQLITE_TEXT;
+}
+
+static int csv_bind_field(sqlite3_stmt* st, int i, const char* str, int len, int quoted, int detect) {
+	sqlite3_int64 iv;
+	double dv;
+
+	if(!quoted && len == 0) return sqlite3_bind_null(st, i);
+
+	if(detect && !quoted) {
+		switch(csv_field_type(str, len, &iv, &dv)) {
+		case SQLITE_INTEGER: return sqlite3_bind_int64(st, i, iv);
+		case SQLITE_FLOAT: return sqlite3_bind_double(st, i, dv);
+		}
+	}
+	return sqlite3_bind_text(st, i, str, len, SQLITE_STATIC);
+}
+
+/*
+ * c:import_csv(table, path, opts) loads a CSV/TSV file with opts
+ *   delimiter ("," ; "\t" for TSV), quote ('"'), header (true),
+ *   detect_types (true), batch (rows per transaction, 10000)
+ * and returns the number of imported rows. The table is created when it
+ * does not exist. Inside an open transaction no intermediate commits are made.
+ */
+LUA_FUNC(connlib_import_csv) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	const char* table = luaL_checkstring(L, 2);
+	const char* path = luaL_checkstring(L, 3);
+	int delim = opt_string(L, 4, "delimiter", ",")[0];
+	int quote = opt_string(L, 4, "quote", "\"")[0];
+	int header = opt_boolean(L, 4, "header", 1);
+	int detect = opt_boolean(L, 4, "detect_types", 1);
+	lua_Integer batch = opt_integer(L, 4, "batch", 10000);
+	int own_tx = sqlite3_get_autocommit(c->handle);
+	sqlite3_stmt* st = NULL;
+	csv_reader* r;
+	lua_Integer count = 0;
+	char* sql = NULL;
+	char* create = NULL;
+	int ret = SQLITE_OK;
+	int n, i;
+
+	if((r = csv_open(path, delim, quote)) == NULL) return luaL_error(L, "can't open %s", path);
+
+	if((n = csv_read_record(r)) <= 0) {
+		csv_close(r);
+		if(n < 0) return luaL_error(L, "out of memory");
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+
+	create = sqlite3_mprintf("CREATE TABLE IF NOT EXISTS \"%w\"(", table);
+	sql = sqlite3_mprintf("INSERT INTO \"%w\"", table);
+	if(header) sql = sqlite3_mprintf("%z(", sql);
+	for(i = 0; i < n; i++) {
+		const char* sep = i ? "," : "";
+		if(header) {
+			create = sqlite3_mprintf("%z%s\"%w\"", create, sep, r->data + r->offs[i]);
+			sql = sqlite3_mprintf("%z%s\"%w\"", sql, sep, r->data + r->offs[i]);
+		} else {
+			create = sqlite3_mprintf("%z%sc%d", create, sep, i + 1);
+		}
+	}
+	create = sqlite3_mprintf("%z)", create);
+	sql = sqlite3_mprintf("%z%s VALUES(", sql, header ? ")" : "");
+	for(i = 0; i < n; i++) sql = sqlite3_mprintf("%z%s?", sql, i ? "," : "");
+	sql = sqlite3_mprintf("%z)", sql);
+
+	if(create == NULL || sql == NULL) {
+		ret = SQLITE_NOMEM;
+		lua_pushstring(L, "out of memory");
+		goto fail;
+	}
+	if((ret = sqlite3_exec(c->handle, create, NULL, NULL, NULL)) != SQLITE_OK
+			|| (ret = sqlite3_prepare_v2(c->handle, sql, -1, &st, NULL)) != SQLITE_OK
+			|| (own_tx && (ret = sqlite3_exec(c->handle, "BEGIN", NULL, NULL, NULL)) != SQLITE_OK)) {
+		lua_pushfstring(L, "[%d] %s", ret, sqlite3_errmsg(c->handle));
+		goto fail;
+	}
+
+	if(header) n = csv_read_record(r);
+	for(; n > 0; n = csv_read_record(r)) {
+		if(n > sqlite3_bind_parameter_count(st)) {
+			ret = SQLITE_MISMATCH;
+			lua_pushfstring(L, "%s: record %d has %d fields, expected %d",
+					path, (int)(count + 1 + header), n, sqlite3_bind_parameter_count(st));
+			goto fail;
+		}
+		sqlite3_clear_bindings(st);
+		for(i = 0; i < n; i++) {
+			csv_bind_field(st, i + 1, r->data + r->offs[i], r->lens[i], r->quoted[i], detect);
+		}
+		while((ret = sqlite3_step(st)) == SQLITE_SCHEMA) {}
+		if(take_hook_error(L, c)) goto fail;
+		if(ret != SQLITE_DONE) {
+			lua_pushfstring(L, "[%d] %s", ret, sqlite3_errmsg(c->handle));
+			goto fail;
+		}
+		sqlite3_reset(st);
+		count++;
+
+		if(own_tx && batch > 0 && count % batch == 0) {
+			if((ret = sqlite3_exec(c->handle, "COMMIT; BEGIN", NULL, NULL, NULL)) != SQLITE_OK) {
+				lua_pushfstring(L, "[%d] %s", ret, sqlite3_errmsg(c->handle));
+				goto fail;
+			}
+			if(take_hook_error(L, c)) goto fail;
+		}
+	}
+	if(n < 0) {
+		ret = SQLITE_NOMEM;
+		lua_pushstring(L, "out of memory");
+		goto fail;
+	}
+	if(own_tx && (ret = sqlite3_exec(c->handle, "COMMIT", NULL, NULL, NULL)) != SQLITE_OK) {
+		lua_pushfstring(L, "[%d] %s", ret, sqlite3_errmsg(c->handle));
+		goto fail;
+	}
+	if(take_hook_error(L, c)) goto fail;
+
+	sqlite3_finalize(st);
+	sqlite3_free(sql);
+	sqlite3_free(create);
+	csv_close(r);
+	deliver_changes(L, c);
+	lua_pushinteger(L, count);
+	return 1;
+
+fail:
+	if(own_tx && !sqlite3_get_autocommit(c->handle)) {
+		sqlite3_exec(c->handle, "ROLLBACK", NULL, NULL, NULL);
+	}
+	sqlite3_finalize(st);
+	sqlite3_free(sql);
+	sqlite3_free(create);
+	csv_close(r);
+	return lua_error(L);
+}
+
+LUA_FUNC(connlib_serialize) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	const char* schema = luaL_optstring(L, 2, "main");
+	sqlite3_int64 size = 0;
+	unsigned char* data;
+
+	/* in-memory databases are usually contiguous and can be read in place */
+	if((data = sqlite3_serialize(c->handle, schema, &size, SQLITE_SERIALIZE_NOCOPY)) != NULL) {
+		lua_pushlstring(L, (const char*)data, (size_t)size);
+		return 1;
+	}
+	if((data = sqlite3_serialize(c->handle, schema, &size, 0)) == NULL) {
+		if(size == 0) {
+			/* empty database */
+			lua_pushliteral(L, "");
+			return 1;
+		}
+		return luaL_error(L, "can't serialize %s", schema);
+	}
+	lua_pushlstring(L, (const char*)data, (size_t)size);
+	sqlite3_free(data);
+	return 1;
+}
+
+/*
+ * c:deserialize(data, opts) replaces the opts.schema ("main") database with
+ * the image in data. opts.readonly keeps it read-only; opts.nocopy makes
+ * SQLite read the Lua string in place (which implies readonly), the string
+ * is then kept alive by the connection until it is replaced or closed.
+ */
+LUA_FUNC(connlib_deserialize) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	size_t len;
+	const char* data = luaL_checklstring(L, 2, &len);
+	const char* schema = opt_string(L, 3, "schema", "main");
+	int readonly = opt_boolean(L, 3, "readonly", 0);
+	int nocopy = opt_boolean(L, 3, "nocopy", 0);
+	unsigned char* buf;
+	unsigned flags;
+	int ret;
+
+	if(nocopy) {
+		buf = (unsigned char*)data;
+		flags = SQLITE_DESERIALIZE_READONLY;
+	} else {
+		if((buf = sqlite3_malloc64(len > 0 ? len : 1)) == NULL) return luaL_error(L, "out of memory");
+		memcpy(buf, data, len);
+		flags = SQLITE_DESERIALIZE_FREEONCLOSE;
+		flags |= readonly ? SQLITE_DESERIALIZE_READONLY : SQLITE_DESERIALIZE_RESIZEABLE;
+	}
+
+	/* on failure SQLite frees buf itself when FREEONCLOSE is set */
+	if((ret = sqlite3_deserialize(c->handle, schema, buf, len, len, flags)) != SQLITE_OK) {
+		return luaL_error(L, "[%d] %s", ret, sqlite3_errmsg(c->handle));
+	}
+	if(c->cache) cache_clear(c->cache); /* data_version may repeat on the new image */
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+	lua_rawgeti(L, -1, IDX_BUFFER_TABLE);
+	lua_pushstring(L, schema);
+	if(nocopy) {
+		lua_pushvalue(L, 2);
+	} else {
+		lua_pushnil(L);
+	}
+	lua_rawset(L, -3);
+	return 0;
+}
+
+
+/*
+ * Maintenance: checkpoints, incremental vacuum and PRAGMA optimize, meant
+ * to run from idle time rather than inside requests.
+ */
+static const char* const checkpoint_modes[] = {"passive", "full", "restart", "truncate", NULL};
+static const int checkpoint_mode_values[] = {
+	SQLITE_CHECKPOINT_PASSIVE, SQLITE_CHECKPOINT_FULL,
+	SQLITE_CHECKPOINT_RESTART, SQLITE_CHECKPOINT_TRUNCATE
+};
+
+static int checkpoint_mode(lua_State* L, const char* name) {
+	int i;
+	for(i = 0; checkpoint_modes[i]; i++) {
+		if(strcmp(checkpoint_modes[i], name) == 0) return checkpoint_mode_values[i];
+	}
+	return luaL_error(L, "invalid checkpoint mode '%s'", name);
+}
+
+/* pushes log frames, checkpointed frames and whether a busy connection cut it short */
+static int checkpoint(lua_State* L, conn* c, const char* schema, int mode) {
+	int log = -1, done = -1;
+	int ret = sqlite3_wal_checkpoint_v2(c->handle, schema, mode, &log, &done);
+
+	if(ret != SQLITE_OK && ret != SQLITE_BUSY) {
+		return luaL_error(L, "[%d] %s", ret, sqlite3_errmsg(c->handle));
+	}
+	lua_pushinteger(L, log);
+	lua_pushinteger(L, done);
+	lua_pushboolean(L, ret == SQLITE_BUSY);
+	return 3;
+}
+
+static int pragma_integer(sqlite3* db, const char* sql, sqlite3_int64* value) {
+	sqlite3_stmt* st;
+	int ret;
+
+	*value = 0;
+	if((ret = sqlite3_prepare_v2(db, sql, -1, &st, NULL)) != SQLITE_OK) return ret;
+	if((ret = sqlite3_step(st)) == SQLITE_ROW) {
+		*value = sqlite3_column_int64(st, 0);
+	}
+	ret = sqlite3_finalize(st);
+	return ret;
+}
+
+/*
+ * frees up to pages (0 for all) free pages; returns the number freed and
+ * how many are left, none unless auto_vacuum is INCREMENTAL
+ */
+static void incremental_vacuum(lua_State* L, conn* c, int pages, sqlite3_int64* freed, sqlite3_int64* left) {
+	sqlite3_int64 before = 0;
+	sqlite3_int64 auto_vacuum;
+	char* sql;
+	int ret;
+
+	if((ret = pragma_integer(c->handle, "PRAGMA auto_vacuum", &auto_vacuum)) != SQLITE_OK ||
+			(auto_vacuum == 2 && (ret = pragma_integer(c->handle, "PRAGMA freelist_count", &before)) != SQLITE_OK)) {
+		luaL_error(L, "[%d] %s", ret, sqlite3_errmsg(c->handle));
+	}
+	*freed = 0;
+	*left = before;
+	if(before == 0) return;
+
+	if((sql = sqlite3_mprintf("PRAGMA incremental_vacuum(%d)", pages)) == NULL) {
+		luaL_error(L, "out of memory");
+	}
+	ret = sqlite3_exec(c->handle, sql, NULL, NULL, NULL);
+	sqlite3_free(sql);
+	if(take_hook_error(L, c)) lua_error(L);
+	if(ret != SQLITE_OK || (ret = pragma_integer(c->handle, "PRAGMA freelist_count", left)) != SQLITE_OK) {
+		luaL_error(L, "[%d] %s", ret, sqlite3_errmsg(c->handle));
+	}
+	*freed = before - *left;
+}
+
+/* c:checkpoint(mode, schema), see checkpoint(); all attached databases without schema */
+LUA_FUNC(connlib_checkpoint) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	int mode = checkpoint_mode_values[luaL_checkoption(L, 2, "passive", checkpoint_modes)];
+	const char* schema = luaL_optstring(L, 3, NULL);
+	return checkpoint(L, c, schema, mode);
+}
+
+/* c:incremental_vacuum(pages) needs auto_vacuum = INCREMENTAL; returns the pages freed */
+LUA_FUNC(connlib_incremental_vacuum) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	int pages = luaL_optint(L, 2, 0);
+	sqlite3_int64 freed, left;
+
+	incremental_vacuum(L, c, pages, &freed, &left);
+	lua_pushinteger(L, freed);
+	return 1;
+}
+
+/*
+ * c:maintenance(opts) does one bounded slice of housekeeping: a checkpoint
+ * (opts.checkpoint, "passive"; false skips it), incremental vacuum in steps
+ * of opts.vacuum_step (64) pages and PRAGMA optimize (opts.optimize, true),
+ * giving up once opts.budget_ms (50) have passed. Returns {log,
+ * checkpointed, busy, vacuumed, optimized, more}; more means another slice
+ * has work left.
+ */
+LUA_FUNC(connlib_maintenance) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	const char* mode = "passive";
+	int vacuum_step = (int)opt_integer(L, 2, "vacuum_step", 64);
+	int optimize = opt_boolean(L, 2, "optimize", 1);
+	sqlite3_int64 deadline = now_ms() + opt_integer(L, 2, "budget_ms", 50);
+	sqlite3_int64 vacuumed = 0, freed, left = 0;
+	int more = 0;
+	int ret;
+
+	if(lua_istable(L, 2)) {
+		lua_getfield(L, 2, "checkpoint");
+		if(lua_isstring(L, -1)) {
+			mode = lua_tostring(L, -1); /* still referenced by opts */
+		} else if(!lua_isnil(L, -1) && !lua_toboolean(L, -1)) {
+			mode = NULL;
+		}
+		lua_pop(L, 1);
+	}
+	if(!sqlite3_get_autocommit(c->handle)) {
+		return luaL_error(L, "maintenance can't run inside a transaction");
+	}
+	if(vacuum_step < 1) vacuum_step = 1;
+	lua_settop(L, 2);
+
+	lua_createtable(L, 0, 6);
+	if(mode) {
+		checkpoint(L, c, NULL, checkpoint_mode(L, mode));
+		lua_setfield(L, 3, "busy");
+		lua_setfield(L, 3, "checkpointed");
+		lua_setfield(L, 3, "log");
+	}
+
+	do {
+		incremental_vacuum(L, c, vacuum_step, &freed, &left);
+		vacuumed += freed;
+	} while(freed > 0 && left > 0 && now_ms() < deadline);
+	if(left > 0) more = 1;
+	lua_pushinteger(L, vacuumed);
+	lua_setfield(L, 3, "vacuumed");
+
+	if(optimize && now_ms() < deadline) {
+		if((ret = sqlite3_exec(c->handle, "PRAGMA optimize", NULL, NULL, NULL)) != SQLITE_OK) {
+			return luaL_error(L, "[%d] %s", ret, sqlite3_errmsg(c->handle));
+		}
+		if(take_hook_error(L, c)) return lua_error(L);
+	} else if(optimize) {
+		more = 1;
+		optimize = 0;
+	}
+	lua_pushboolean(L, optimize);
+	lua_setfield(L, 3, "optimized");
+	lua_pushboolean(L, more);
+	lua_setfield(L, 3, "more");
+	return 1;
+}
+
+/*
+ * Group commit: c:submit_write(target, params, callback) queues a write,
+ * where target is a function called as target(params) or a statement that
+ * is bound with params and run with exec_update. Queued writes run in one
+ * transaction, each inside its own savepoint so a failing write is rolled
+ * back alone. The queue is flushed when it holds max_count writes, when a
+ * submit finds the oldest write older than max_delay_ms, or by
+ * c:flush_writes(); an event loop should call flush_writes when idle.
+ * Writes are only flushed outside of a transaction: flush_writes raises an
+ * error inside one and submit_write keeps queueing. close() flushes what
+ * is still queued, or fails it when a transaction is open; a connection
+ * that is garbage collected fails its queued writes without running them
+ * or their callbacks.
+ *
+ * submit_write returns a ticket that gets done, ok and result or error
+ * once flushed; callback(ok, result_or_error) is called at the same time.
+ * The first error a callback raises is kept and raised by the next
+ * c:flush_writes(), so a submit that flushes still returns its ticket.
+ */
+#define WRITE_SAVEPOINT "lsqlite3lib_write"
+
+LUA_FUNC(stmtlib_bind);
+LUA_FUNC(stmtlib_exec_update);
+
+/* (target, params) -> result, the connection is upvalue 1 */
+LUA_FUNC(write_entry_run) {
+	conn* c = (conn*)lua_touserdata(L, lua_upvalueindex(1));
+	stmt* s;
+
+	if(lua_isfunction(L, 1)) {
+		lua_call(L, 1, 1);
+		return 1;
+	}
+	s = (stmt*)luaL_checkudata(L, 1, MT_STMT);
+	if(s->handle == NULL) return luaL_error(L, "statement is finalized");
+	if(s->c != c) return luaL_error(L, "statement belongs to another connection");
+	if(lua_istable(L, 2)) stmtlib_bind(L);
+	lua_settop(L, 1);
+	return stmtlib_exec_update(L);
+}
+
+static void set_ticket(lua_State* L, int ticket, int ok, int value) {
+	lua_pushboolean(L, ok);
+	lua_setfield(L, ticket, "ok");
+	lua_pushvalue(L, value);
+	lua_setfield(L, ticket, ok ? "result" : "error");
+	if(!ok) {
+		lua_pushnil(L);
+		lua_setfield(L, ticket, "result");
+	}
+}
+
+/*
+ * runs the queued writes in a transaction of their own, the caller checks
+ * that none is open; with abandon set they all fail with that message
+ * instead. The first callback error goes to conn.write_error; without
+ * callbacks neither the write callbacks nor the update hook run.
+ */
+static int flush_writes(lua_State* L, conn* c, const char* abandon, int callbacks) {
+	int top = lua_gettop(L);
+	int queue, n, i;
+	int failed = 0; /* the transaction itself failed, message on top of the stack */
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+	lua_rawgeti(L, -1, IDX_WRITE_QUEUE);
+	queue = lua_gettop(L);
+	if((n = lua_rawlen(L, queue)) == 0) {
+		lua_settop(L, top);
+		return 0;
+	}
+	/* detach the queue, callbacks may submit new writes */
+	lua_newtable(L);
+	lua_rawseti(L, queue - 1, IDX_WRITE_QUEUE);
+	c->write_count = 0;
+
+	if(abandon) {
+		lua_pushstring(L, abandon);
+		failed = 1;
+	} else if(sqlite3_exec(c->handle, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+		lua_pushstring(L, sqlite3_errmsg(c->handle));
+		failed = 1;
+	}
+
+	for(i = 1; i <= n && !failed; i++) {
+		int entry, ticket;
+		/* where this write's row changes start, ROLLBACK TO has no hook */
+		int n_changes = c->n_changes;
+		int changes_overflow = c->changes_overflow;
+		lua_rawgeti(L, queue, i);
+		entry = lua_gettop(L);
+		lua_rawgeti(L, entry, 4);
+		ticket = lua_gettop(L);
+
+		if(sqlite3_exec(c->handle, "SAVEPOINT " WRITE_SAVEPOINT, NULL, NULL, NULL) != SQLITE_OK) {
+			lua_pushfstring(L, "[%d] %s", sqlite3_errcode(c->handle), sqlite3_errmsg(c->handle));
+			set_ticket(L, ticket, 0, -1);
+		} else {
+			lua_pushlightuserdata(L, c);
+			lua_pushcclosure(L, write_entry_run, 1);
+			lua_rawgeti(L, entry, 1);
+			lua_rawgeti(L, entry, 2);
+			if(lua_pcall(L, 2, 1, 0) == LUA_OK) {
+				sqlite3_exec(c->handle, "RELEASE " WRITE_SAVEPOINT, NULL, NULL, NULL);
+				set_ticket(L, ticket, 1, -1);
+			} else {
+				sqlite3_exec(c->handle, "ROLLBACK TO " WRITE_SAVEPOINT "; RELEASE " WRITE_SAVEPOINT,
+						NULL, NULL, NULL);
+				c->n_changes = n_changes;
+				c->changes_overflow = changes_overflow;
+				set_ticket(L, ticket, 0, -1);
+			}
+		}
+		lua_settop(L, queue);
+	}
+
+	if(!failed && sqlite3_exec(c->handle, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+		lua_pushstring(L, sqlite3_errmsg(c->handle));
+		failed = 1;
+		if(!sqlite3_get_autocommit(c->handle)) sqlite3_exec(c->handle, "ROLLBACK", NULL, NULL, NULL);
+	}
+	/* the writes are committed, a WAL hook error is reported like a callback's */
+	if(!c->write_error && c->hook_error) {
+		c->write_error = c->hook_error;
+		c->hook_error = 0;
+	}
+
+	for(i = 1; i <= n; i++) {
+		int entry, ticket;
+		lua_rawgeti(L, queue, i);
+		entry = lua_gettop(L);
+		lua_rawgeti(L, entry, 4);
+		ticket = lua_gettop(L);
+
+		if(failed) set_ticket(L, ticket, 0, queue + 1);
+		lua_pushboolean(L, 1);
+		lua_setfield(L, ticket, "done");
+
+		lua_rawgeti(L, entry, 3);
+		if(callbacks && lua_isfunction(L, -1)) {
+			lua_getfield(L, ticket, "ok");
+			lua_getfield(L, ticket, lua_toboolean(L, -1) ? "result" : "error");
+			if(lua_pcall(L, 2, 0, 0) != LUA_OK && !c->write_error) {
+				c->write_error = luaL_ref(L, LUA_REGISTRYINDEX);
+			}
+		}
+		lua_settop(L, queue + failed);
+	}
+
+	lua_settop(L, top);
+	if(callbacks) deliver_changes(L, c);
+	return n;
+}
+
+/* c:set_write_batching{max_count = 100, max_delay_ms = 10} */
+LUA_FUNC(connlib_set_write_batching) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	c->write_max_count = opt_integer(L, 2, "max_count", 100);
+	c->write_max_delay = opt_integer(L, 2, "max_delay_ms", 10);
+	return 0;
+}
+
+LUA_FUNC(connlib_submit_write) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	int n;
+
+	if(!lua_isfunction(L, 2) && ((stmt*)luaL_checkudata(L, 2, MT_STMT))->c != c) {
+		return luaL_argerror(L, 2, "statement is finalized or belongs to another connection");
+	}
+	lua_settop(L, 4);
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+	lua_rawgeti(L, -1, IDX_WRITE_QUEUE);
+	n = lua_rawlen(L, -1);
+
+	lua_createtable(L, 4, 0);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, 1);
+	lua_pushvalue(L, 3);
+	lua_rawseti(L, -2, 2);
+	lua_pushvalue(L, 4);
+	lua_rawseti(L, -2, 3);
+	lua_createtable(L, 0, 4); /* ticket */
+	lua_pushboolean(L, 0);
+	lua_setfield(L, -2, "done");
+	lua_pushvalue(L, -1);
+	lua_insert(L, 5); /* keep the ticket as the result */
+	lua_rawseti(L, -2, 4);
+	lua_rawseti(L, -2, n + 1);
+
+	if(c->write_count++ == 0) c->write_first = now_ms();
+	if(sqlite3_get_autocommit(c->handle) && (c->write_count >= c->write_max_count
+			|| now_ms() - c->write_first >= c->write_max_delay)) {
+		flush_writes(L, c, NULL, 1);
+	}
+	lua_settop(L, 5);
+	return 1;
+}
+
+LUA_FUNC(connlib_flush_writes) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	if(!sqlite3_get_autocommit(c->handle)) {
+		return luaL_error(L, "can't flush writes inside a transaction");
+	}
+	lua_pushinteger(L, flush_writes(L, c, NULL, 1));
+	if(c->write_error) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, c->write_error);
+		luaL_unref(L, LUA_REGISTRYINDEX, c->write_error);
+		c->write_error = 0;
+		return lua_error(L);
+	}
+	return 1;
+}
+
+LUA_FUNC(connlib_pending_writes) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	lua_pushinteger(L, c->write_count);
+	return 1;
+}
+
+LUA_FUNC(connlib_tostring) {
+	conn* c = (conn*)luaL_checkudata(L, 1, MT_CONN);
+	if (!c->handle)
+		lua_pushfstring(L, "%s (closed)", MT_CONN);
+	else
+		lua_pushfstring(L, "%s (%p)", MT_CONN, c->handle);
+	return 1;
+}
+
+static const luaL_Reg connlib[] = {
+	{"close", connlib_close},
+
+	{"prepare", connlib_prepare},
+	{"statements", connlib_statements},
+	{"exec", connlib_exec},
+	{"run_script", connlib_run_script},
+
+	{"begin", connlib_begin},
+	{"commit", connlib_commit},
+	{"rollback", connlib_rollback},
+	{"in_transaction", connlib_in_transaction},
+
+	{"interrupt", connlib_interrupt},
+	{"set_default_timeout", connlib_set_default_timeout},
+	{"aborted_queries", connlib_aborted_queries},
+
+	{"set_rollback_hook", connlib_set_rollback_hook},
+	{"set_commit_hook", connlib_set_commit_hook},
+	{"set_update_hook", connlib_set_update_hook},
+	{"set_trace_callback", connlib_set_trace_callback},
+	{"set_profile_callback", connlib_set_profile_callback},
+	{"set_wal_hook", connlib_set_wal_hook},
+
+	{"set_function", connlib_set_function},
+	{"set_aggregate", connlib_set_aggregate},
+	{"set_collation", connlib_set_collation},
+	{"create_module", connlib_create_module},
+
+	{"import_csv", connlib_import_csv},
+
+	{"set_result_cache", connlib_set_result_cache},
+	{"result_cache_stats", connlib_result_cache_stats},
+
+	{"set_write_batching", connlib_set_write_batching},
+	{"submit_write", connlib_submit_write},
+	{"flush_writes", connlib_flush_writes},
+	{"pending_writes", connlib_pending_writes},
+
+	{"checkpoint", connlib_checkpoint},
+	{"incremental_vacuum", connlib_incremental_vacuum},
+	{"maintenance", connlib_maintenance},
+
+	{"serialize", connlib_serialize},
+	{"deserialize", connlib_deserialize},
+
+	{"__gc", connlib_gc},
+	{"__tostring", connlib_tostring},
+
+	{NULL, NULL}
+};
+
+static int stmt_timeout(stmt* s) {
+	if(s->timeout > 0) return s->timeout;
+	return s->c ? s->c->default_timeout : 0;
+}
+
+/* the deadline covers one execution: from the first step after a reset until it is done */
+static int stmt_step(lua_State* L, stmt* s) {
+	conn* c = s->c;
+	int timeout = stmt_timeout(s);
+	sqlite3_int64 outer_deadline = c ? c->deadline : 0;
+	int outer_timed_out = c ? c->timed_out : 0;
+	int ret;
+
+	s->generation++;
+	if(!sqlite3_stmt_busy(s->handle)) {
+		s->started = now_ms();
+		sqlite3_stmt_status(s->handle, SQLITE_STMTSTATUS_VM_STEP, 1);
+	}
+	if(c) {
+		c->timed_out = 0;
+		c->deadline = query_deadline(c, s->started, timeout);
+	}
+	while((ret = sqlite3_step(s->handle)) == SQLITE_SCHEMA) {}
+	s->timed_out = 0;
+	if(c) {
+		s->timed_out = ret == SQLITE_INTERRUPT && c->timed_out;
+		if(ret == SQLITE_INTERRUPT) {
+			record_abort(c, sqlite3_sql(s->handle), s->started,
+					sqlite3_stmt_status(s->handle, SQLITE_STMTSTATUS_VM_STEP, 0));
+		}
+		c->deadline = outer_deadline;
+		c->timed_out = outer_timed_out;
+		if(ret == SQLITE_DONE) deliver_changes(L, c);
+		/* stmt_error raises it */
+		if(c->hook_error && (ret == SQLITE_ROW || ret == SQLITE_DONE)) {
+			sqlite3_reset(s->handle);
+			ret = SQLITE_ERROR;
+		}
+	}
+	return ret;
+}
+
+/* raises the error for a failed stmt_step, timeouts get their own message */
+static int stmt_error(lua_State* L, stmt* s, int ret) {
+	if(s->c && take_hook_error(L, s->c)) return lua_error(L);
+	if(ret == SQLITE_INTERRUPT && s->timed_out) {
+		return timeout_error(L, stmt_timeout(s));
+	}
+	return luaL_error(L, "[%d] %s", ret, sqlite3_errmsg(sqlite3_db_handle(s->handle)));
+}
+
+/* stmt:set_timeout(ms) bounds each execution of the statement, 0 uses the connection default */
+LUA_FUNC(stmtlib_set_timeout) {
+	stmt* s = (stmt*)luaL_checkudata(L, 1, MT_STMT);
+	s->timeout = luaL_optint(L, 2, 0);
+	if(s->timeout > 0 && s->c) install_progress_handler(s->c);
+	return 0;
+}
+
+/* stmt:set_cacheable(true) lets fetch_all use the connection's result cache */
+LUA_FUNC(stmtlib_set_cacheable) {
+	stmt* s = (stmt*)luaL_checkudata(L, 1, MT_STMT);
+	s->cacheable = lua_toboolean(L, 2);
+	return 0;
+}
+
+LUA_FUNC(stmtlib_sql) {
+	stmt* s = (stmt*)luaL_checkudata(L, 1, MT_STMT);
+	lua_pushstring(L, sqlite3_sql(s->handle));
+	return 1;
+}
+
+LUA_FUNC(stmtlib_reset) {
+	stmt* s = (stmt*)luaL_checkudata(L, 1, MT_STMT);
+	s->generation++;
+	sqlite3_reset(s->handle);
+	deliver_changes(L, s->c);
+	return 0;
+}
+
+/* encodes the values collected by stmtlib_bind, by parameter index, as the result cache key */
+static void record_params(lua_State* L, stmt* s, int values, int param_count) {
+	enc_buffer b = {NULL, 0, 0, 0};
+	int i;
+
+	for(i = 1; i <= param_count; i++) {
+		unsigned char tag;
+		lua_rawgeti(L, values, i);
+		if(lua_type(L, -1) == LUA_TNUMBER) {
+			double v = lua_tonumber(L, -1);
+			tag = ENC_FLOAT;
+			enc_put(&b, &tag, 1);
+			enc_put(&b, &v, sizeof(v));
+		} else if(lua_type(L, -1) == LUA_TSTRING) {
+			const char* str = lua_tostring(L, -1);
+			tag = ENC_TEXT;
+			enc_put(&b, &tag, 1);
+			enc_put_int(&b, strlen(str));
+			enc_put(&b, str, strlen(str));
+		} else {
+			tag = ENC_NULL;
+			enc_put(&b, &tag, 1);
+		}
+		lua_pop(L, 1);
+	}
+	if(b.oom) {
+		sqlite3_free(b.p);
+		s->uncacheable = 1;
+		return;
+	}
+	s->params = b.p;
+	s->params_len = b.n;
+}
+
+LUA_FUNC(stmtlib_bind) {
+	int i;
+	int param_count;
+	int values = 0;
+	stmt* s = (stmt*)luaL_checkudata(L, 1, MT_STMT);
+
+	if(!lua_istable(L, 2)) {
+		char msg[256];
+		sprintf(msg, "table expected, got %s", lua_typename(L, 2));
+		return luaL_argerror(L, 2, msg);
+	}
+
+	s->generation++;
+	s->uncacheable = 0;
+	sqlite3_free(s->params);
+	s->params = NULL;
+	sqlite3_reset(s->handle);
+	sqlite3_clear_bindings(s->handle);
+	param_count = sqlite3_bind_parameter_count(s->handle);
+
+	/*
+	 * with the result cache on, keep the values by index for its key; the
+	 * expanded SQL can't be used, it prints doubles with 15 digits
+	 */
+	if(s->c && s->c->cache && s->cacheable && param_count > 0) {
+		lua_settop(L, 2);
+		lua_createtable(L, param_count, 0);
+		values = 3;
+	}
+
+	lua_pushnil(L);
+	while (lua_next(L, 2) != 0) {
+		int index = 0;
+		const char* str;
+
+		if(lua_isnumber(L, -2)) {
+			index = lua_tointeger(L, -2);
+		} else if(lua_isstring(L, -2)) {
+			str = lua_tostring(L, -2);
+			if(*str == ':' || *str == '@' || *str == '$') {
+				index = sqlite3_bind_parameter_index(s->handle, str);
 			} else {
 				for(i=0;i<param_count;i++) {
 					if(strcmp(sqlite3_bind_parameter_name(s->handle, i+1)+1, str) == 0) {
@@ -721,6 +3316,10 @@ LUA_FUNC(stmtlib_bind) {
 		}
 
 		if(index != 0) {
+			if(values && index > 0 && index <= param_count) {
+				lua_pushvalue(L, -1);
+				lua_rawseti(L, values, index);
+			}
 			switch(lua_type(L, -1)) {
 			case LUA_TNUMBER:
 				sqlite3_bind_double(s->handle, index, lua_tonumber(L, -1));
@@ -729,6 +3328,14 @@ LUA_FUNC(stmtlib_bind) {
 				str = lua_tostring(L, -1);
 				sqlite3_bind_text(s->handle, index, str, strlen(str), SQLITE_TRANSIENT);
 				break;
+			case LUA_TTABLE: {
+					/* for use with carray(?) */
+					array* a = array_pack(L, lua_gettop(L));
+					if(a == NULL) return luaL_argerror(L, 2, lua_tostring(L, -1));
+					sqlite3_bind_pointer(s->handle, index, a, ARRAY_POINTER_TYPE, sqlite3_free);
+					s->uncacheable = 1;
+					break;
+				}
 			case LUA_TNIL:
 			default:
 				sqlite3_bind_null(s->handle, index);
@@ -737,6 +3344,7 @@ LUA_FUNC(stmtlib_bind) {
 		}
 		lua_pop(L, 1);
 	}
+	if(values && !s->uncacheable) record_params(L, s, values, param_count);
 	return 0;
 }
 
@@ -744,9 +3352,9 @@ LUA_FUNC(stmtlib_exec_update) {
 	stmt* s = (stmt*)luaL_checkudata(L, 1, MT_STMT);
 	sqlite3* db = sqlite3_db_handle(s->handle);
 	int ret;
-	while((ret = sqlite3_step(s->handle)) == SQLITE_SCHEMA) {};
+	ret = stmt_step(L, s);
 	if(ret != SQLITE_DONE && ret != SQLITE_ROW) {
-		return luaL_error(L, "[%d] %s", ret, sqlite3_errmsg(db));
+		return stmt_error(L, s, ret);
 	}
 	lua_pushinteger(L, sqlite3_changes(db));
 	return 1;
@@ -797,9 +3405,7 @@ LUA_FUNC(stmtlib_icolumn_types) {
 
 static int fetch(lua_State* L, int mode) {
 	stmt* s = (stmt*)luaL_checkudata(L, 1, MT_STMT);
-	sqlite3* db = sqlite3_db_handle(s->handle);
-	int ret;
-	while((ret = sqlite3_step(s->handle)) == SQLITE_SCHEMA) {}
+	int ret = stmt_step(L, s);
 	if(ret == SQLITE_DONE) {
 		lua_pushnil(L);
 		return 1;
@@ -837,7 +3443,7 @@ static int fetch(lua_State* L, int mode) {
 		return 1;
 
 	}
-	return luaL_error(L, "[%d] %s", ret, sqlite3_errmsg(db));
+	return stmt_error(L, s, ret);
 }
 
 LUA_FUNC(stmtlib_fetch) {
@@ -861,28 +3467,819 @@ LUA_FUNC(stmtlib_irows) {
 	lua_pushnil(L);
 	return 3;
 }
+static void push_column(lua_State* L, sqlite3_stmt* st, int i) {
+	switch(sqlite3_column_type(st, i)) {
+	case SQLITE_INTEGER:
+		lua_pushinteger(L, sqlite3_column_int64(st, i));
+		break;
+	case SQLITE_FLOAT:
+		lua_pushnumber(L, sqlite3_column_double(st, i));
+		break;
+	case SQLITE_TEXT:
+	case SQLITE_BLOB: {
+			const char* p = (const char*)sqlite3_column_blob(st, i);
+			lua_pushlstring(L, p, sqlite3_column_bytes(st, i));
+			break;
+		}
+	case SQLITE_NULL:
+	default:
+		lua_pushnil(L);
+		break;
+	}
+}
 
-LUA_FUNC(stmtlib_finalize) {
+/*
+ * stmt:fetch_all() / stmt:ifetch_all() return every remaining row as an
+ * array of fetch / ifetch style tables, served from the connection's result
+ * cache when enabled. Only read-only statements that opted in with
+ * set_cacheable are cached, outside an explicit transaction; statements
+ * with bound arrays never are.
+ */
+static int fetch_all(lua_State* L, int mode) {
 	stmt* s = (stmt*)luaL_checkudata(L, 1, MT_STMT);
+	sqlite3* db = sqlite3_db_handle(s->handle);
+	result_cache* rc = s->c ? s->c->cache : NULL;
+	int col_count = sqlite3_column_count(s->handle);
+	enc_buffer b = {NULL, 0, 0, 0};
+	enc_buffer key = {NULL, 0, 0, 0};
+	size_t row_count_at = 0;
+	unsigned hash = 0;
+	int row_count = 0;
+	int ret, i;
+
+	/* a statement in the middle of an execution would only add the remaining rows */
+	if(rc && s->cacheable && !s->uncacheable && !sqlite3_stmt_busy(s->handle) && sqlite3_stmt_readonly(s->handle)
+			&& sqlite3_get_autocommit(db)
+			&& (s->params || sqlite3_bind_parameter_count(s->handle) == 0)) {
+		const char* sql = sqlite3_sql(s->handle);
+		cache_check_version(rc, db);
+		enc_put(&key, sql, strlen(sql) + 1);
+		if(s->params) enc_put(&key, s->params, s->params_len);
+		if(!key.oom) {
+			cache_entry* e = cache_lookup(rc, &key, hash = cache_hash(key.p, key.n));
+			if(e) {
+				rc->hits++;
+				sqlite3_free(key.p);
+				cache_decode(L, e->data, mode);
+				return 1;
+			}
+			rc->misses++;
+
+			enc_put_int(&b, col_count);
+			for(i = 0; i < col_count; i++) {
+				const char* name = sqlite3_column_name(s->handle, i);
+				enc_put_int(&b, strlen(name));
+				enc_put(&b, name, strlen(name));
+			}
+			row_count_at = b.n;
+			enc_put_int(&b, 0);
+		}
+	}
 
-	if(s->handle) {
-		sqlite3* db = sqlite3_db_handle(s->handle);
-		int ret = sqlite3_finalize(s->handle);
-		if(ret != SQLITE_OK) {
-			return luaL_error(L, "[%d] %s", ret, sqlite3_errmsg(db));
+	lua_newtable(L);
+	while((ret = stmt_step(L, s)) == SQLITE_ROW) {
+		lua_createtable(L, mode == 1 ? col_count : 0, mode == 0 ? col_count : 0);
+		for(i = 0; i < col_count; i++) {
+			if(mode == 0) {
+				lua_pushstring(L, sqlite3_column_name(s->handle, i));
+			} else {
+				lua_pushinteger(L, i + 1);
+			}
+			push_column(L, s->handle, i);
+			lua_rawset(L, -3);
+			if(key.n) enc_put_column(&b, s->handle, i);
 		}
+		lua_rawseti(L, -2, ++row_count);
+	}
+
+	if(ret == SQLITE_DONE && key.n && !key.oom && !b.oom) {
+		memcpy(b.p + row_count_at, &row_count, sizeof(int));
+		cache_insert(rc, &key, hash, &b);
+	}
+	sqlite3_free(key.p);
+	sqlite3_free(b.p);
+
+	if(ret != SQLITE_DONE) return stmt_error(L, s, ret);
+	return 1;
+}
+
+LUA_FUNC(stmtlib_fetch_all) {
+	return fetch_all(L, 0);
+}
 
-		lua_rawgeti(L, LUA_REGISTRYINDEX, s->c->ref);
-		lua_rawgeti(L, -1, IDX_STMT_TABLE);
+LUA_FUNC(stmtlib_ifetch_all) {
+	return fetch_all(L, 1);
+}
+
+LUA_FUNC(stmtlib_lazy_next) {
+	stmt* s = (stmt*)luaL_checkudata(L, 1, MT_STMT);
+	row* r = (row*)lua_touserdata(L, lua_upvalueindex(1));
+	int ret = stmt_step(L, s);
 
-		lua_pushlightuserdata(L, s->handle);
+	if(ret == SQLITE_DONE) {
 		lua_pushnil(L);
+		return 1;
+	} else if(ret == SQLITE_ROW) {
+		r->generation = s->generation;
+		lua_pushvalue(L, lua_upvalueindex(1));
+		return 1;
+	}
+	return stmt_error(L, s, ret);
+}
+
+/*
+ * for row in stmt:lazy_rows() do ... end yields one reusable row proxy; a
+ * column is converted only when row.name or row[n] reads it. The proxy is
+ * valid until the statement steps again; row:copy() returns a fetch-style
+ * table. Columns shadow the copy method, use an index for a column named copy.
+ */
+LUA_FUNC(stmtlib_lazy_rows) {
+	stmt* s = (stmt*)luaL_checkudata(L, 1, MT_STMT);
+	int col_count = sqlite3_column_count(s->handle);
+	row* r;
+	int i;
+
+	r = (row*)lua_newuserdata(L, sizeof(row));
+	r->s = s;
+	r->generation = s->generation - 1; /* not valid before the first step */
+
+	/* name -> index map, [0] keeps the statement alive */
+	lua_createtable(L, 1, col_count);
+	for(i = 0; i < col_count; i++) {
+		lua_pushstring(L, sqlite3_column_name(s->handle, i));
+		lua_pushinteger(L, i);
 		lua_rawset(L, -3);
+	}
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 0);
+	lua_setuservalue(L, -2);
+	luaL_setmetatable(L, MT_ROW);
 
-		lua_pop(L, 2);
+	lua_pushcclosure(L, stmtlib_lazy_next, 1);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+static row* check_row(lua_State* L) {
+	row* r = (row*)luaL_checkudata(L, 1, MT_ROW);
+	if(r->s->handle == NULL || r->generation != r->s->generation) {
+		luaL_error(L, "row is no longer valid");
+	}
+	return r;
+}
+
+LUA_FUNC(rowlib_copy) {
+	row* r = check_row(L);
+	int col_count = sqlite3_column_count(r->s->handle);
+	int i;
+
+	lua_createtable(L, 0, col_count);
+	for(i = 0; i < col_count; i++) {
+		lua_pushstring(L, sqlite3_column_name(r->s->handle, i));
+		push_column(L, r->s->handle, i);
+		lua_rawset(L, -3);
+	}
+	return 1;
+}
+
+LUA_FUNC(rowlib_index) {
+	row* r = check_row(L);
+	int i = -1;
+
+	if(lua_type(L, 2) == LUA_TNUMBER) {
+		i = lua_tointeger(L, 2) - 1;
+	} else {
+		lua_getuservalue(L, 1);
+		lua_pushvalue(L, 2);
+		lua_rawget(L, -2);
+		if(lua_isnumber(L, -1)) {
+			i = lua_tointeger(L, -1);
+		} else if(lua_type(L, 2) == LUA_TSTRING && strcmp(lua_tostring(L, 2), "copy") == 0) {
+			lua_pushcfunction(L, rowlib_copy);
+			return 1;
+		}
+	}
+
+	if(i < 0 || i >= sqlite3_column_count(r->s->handle)) {
+		lua_pushnil(L);
+	} else {
+		push_column(L, r->s->handle, i);
+	}
+	return 1;
+}
+
+LUA_FUNC(rowlib_len) {
+	row* r = check_row(L);
+	lua_pushinteger(L, sqlite3_column_count(r->s->handle));
+	return 1;
+}
+
+LUA_FUNC(rowlib_tostring) {
+	row* r = (row*)luaL_checkudata(L, 1, MT_ROW);
+	if(r->s->handle == NULL || r->generation != r->s->generation)
+		lua_pushfstring(L, "%s (invalid)", MT_ROW);
+	else
+		lua_pushfstring(L, "%s (%p)", MT_ROW, r->s->handle);
+	return 1;
+}
+
+static const luaL_Reg rowlib[] = {
+	{"__index", rowlib_index},
+	{"__len", rowlib_len},
+	{"__tostring", rowlib_tostring},
+	{NULL, NULL}
+};
+
+/* decimal digits of v, buf needs 21 bytes; returns the length */
+static size_t format_int64(char* buf, sqlite3_int64 v) {
+	char tmp[20];
+	sqlite3_uint64 u = v < 0 ? 0 - (sqlite3_uint64)v : (sqlite3_uint64)v;
+	size_t n = 0;
+	size_t len = 0;
+
+	do {
+		tmp[n++] = (char)('0' + u % 10);
+		u /= 10;
+	} while(u);
+	if(v < 0) buf[len++] = '-';
+	while(n) buf[len++] = tmp[--n];
+	buf[len] = 0;
+	return len;
+}
+
+/*
+ * formats d so that it reads back as the same double: whole numbers below
+ * 2^53 as "12.0", anything else with 17 significant digits. With shortest
+ * set, short decimals like 0.1 are printed without snprintf and the rest
+ * with 15 digits when that is enough. buf needs 32 bytes; returns the length.
+ */
+static size_t format_double(char* buf, double d, int shortest) {
+	static const double scale[] = {1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+		1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17};
+	size_t n;
+	size_t k;
+	char* p;
+
+	if(d > -9007199254740992.0 && d < 9007199254740992.0 && d == (double)(sqlite3_int64)d) {
+		n = format_int64(buf, (sqlite3_int64)d);
+		memcpy(buf + n, ".0", 3);
+		return n + 2;
+	}
+	/*
+	 * fewest decimals k with m, d * 10^k rounded to a whole number below
+	 * 2^53, giving m / 10^k == d: both operands are exact, so the division
+	 * rounds the same way strtod does and printing m with k decimals is exact
+	 */
+	for(k = 0; shortest && k < sizeof(scale) / sizeof(scale[0]); k++) {
+		double m = d * scale[k];
+		size_t dec = k + 1;
+		char digits[21];
+		size_t nd;
+
+		if(!(m > -9007199254740992.0 && m < 9007199254740992.0)) break;
+		m = (double)(sqlite3_int64)(m < 0 ? m - 0.5 : m + 0.5);
+		if(m / scale[k] != d) continue;
+		nd = format_int64(digits, (sqlite3_int64)(m < 0 ? -m : m));
+		n = 0;
+		if(m < 0) buf[n++] = '-';
+		if(nd > dec) {
+			memcpy(buf + n, digits, nd - dec);
+			n += nd - dec;
+		} else {
+			buf[n++] = '0';
+		}
+		buf[n++] = '.';
+		for(; nd < dec; dec--) buf[n++] = '0';
+		memcpy(buf + n, digits + nd - dec, dec + 1); /* with the NUL */
+		return n + dec;
+	}
+	/*
+	 * between 0.001 and 2^53 that loop already found the short forms, so
+	 * go straight to 17 digits; libc rounds exactly, sqlite3_snprintf does
+	 * not for large exponents
+	 */
+	if(!shortest || ((d <= -0.001 || d >= 0.001) && d > -9007199254740992.0 && d < 9007199254740992.0)
+			|| (snprintf(buf, 32, "%.15g", d), strtod(buf, NULL) != d)) {
+		snprintf(buf, 32, "%.17g", d);
+	}
+	for(p = buf; *p; p++) {
+		if(*p == ',') *p = '.'; /* decimal point of the current locale */
+	}
+	n = p - buf;
+	if(!strpbrk(buf, ".en")) { /* keep it a REAL: 1e+20 and inf/nan are fine */
+		memcpy(buf + n, ".0", 3);
+		n += 2;
+	}
+	return n;
+}
+
+typedef struct {
+	FILE* fp;
+	int error;
+	size_t n;
+	char buf[CSV_BUFSIZE];
+} csv_writer;
+
+static void csv_put(csv_writer* w, const char* p, size_t n) {
+	if(w->n + n > CSV_BUFSIZE) {
+		if(w->n && fwrite(w->buf, 1, w->n, w->fp) != w->n) w->error = 1;
+		w->n = 0;
+		if(n > CSV_BUFSIZE) {
+			if(fwrite(p, 1, n, w->fp) != n) w->error = 1;
+			return;
+		}
+	}
+	memcpy(w->buf + w->n, p, n);
+	w->n += n;
+}
+
+/*
+ * text is set for NUL-terminated TEXT values, which are quoted when empty
+ * or when import_csv would read them as a number, so they come back as TEXT
+ */
+static void csv_put_text(csv_writer* w, const char* p, size_t n, char delim, char quote, int text) {
+	size_t i;
+	size_t from = 0;
+	sqlite3_int64 iv;
+	double dv;
+	int needs_quote = n == 0 ? text : p[0] == ' ' || p[n - 1] == ' ';
+
+	if(!needs_quote && text) {
+		needs_quote = csv_field_type(p, (int)n, &iv, &dv) != SQLITE_TEXT;
+	}
+	for(i = 0; i < n && !needs_quote; i++) {
+		char ch = p[i];
+		needs_quote = ch == delim || ch == quote || ch == '\n' || ch == '\r';
+	}
+	if(!needs_quote) {
+		csv_put(w, p, n);
+		return;
+	}
+	csv_put(w, &quote, 1);
+	for(i = 0; i < n; i++) {
+		if(p[i] == quote) {
+			csv_put(w, p + from, i + 1 - from); /* doubles the quote */
+			from = i;
+		}
+	}
+	csv_put(w, p + from, n - from);
+	csv_put(w, &quote, 1);
+}
+
+/*
+ * stmt:export_csv(path_or_file, opts) steps the statement and writes every
+ * row with opts delimiter (","), quote ('"'), header (true), null ("") and
+ * newline ("\n"); returns the number of rows written. Empty TEXT and TEXT
+ * that import_csv would read as a number are quoted.
+ */
+LUA_FUNC(stmtlib_export_csv) {
+	stmt* s = (stmt*)luaL_checkudata(L, 1, MT_STMT);
+	luaL_Stream* stream = (luaL_Stream*)luaL_testudata(L, 2, LUA_FILEHANDLE);
+	char delim = opt_string(L, 3, "delimiter", ",")[0];
+	char quote = opt_string(L, 3, "quote", "\"")[0];
+	int header = opt_boolean(L, 3, "header", 1);
+	const char* null = opt_string(L, 3, "null", "");
+	const char* newline = opt_string(L, 3, "newline", "\n");
+	size_t null_len = strlen(null);
+	size_t newline_len = strlen(newline);
+	int col_count = sqlite3_column_count(s->handle);
+	lua_Integer count = 0;
+	csv_writer* w;
+	FILE* fp;
+	int ret, i;
+
+	if(stream) {
+		if(stream->closef == NULL) return luaL_argerror(L, 2, "attempt to use a closed file");
+		fp = stream->f;
+	} else {
+		const char* path = luaL_checkstring(L, 2);
+		if((fp = fopen(path, "wb")) == NULL) return luaL_error(L, "can't open %s", path);
+	}
+	if((w = sqlite3_malloc(sizeof(csv_writer))) == NULL) {
+		if(!stream) fclose(fp);
+		return luaL_error(L, "out of memory");
+	}
+	w->fp = fp;
+	w->error = 0;
+	w->n = 0;
+
+	if(header) {
+		for(i = 0; i < col_count; i++) {
+			const char* name = sqlite3_column_name(s->handle, i);
+			if(i) csv_put(w, &delim, 1);
+			csv_put_text(w, name, strlen(name), delim, quote, 0);
+		}
+		csv_put(w, newline, newline_len);
+	}
+
+	for(;;) {
+		if((ret = stmt_step(L, s)) != SQLITE_ROW) break;
+
+		for(i = 0; i < col_count; i++) {
+			char num[32];
+			if(i) csv_put(w, &delim, 1);
+			switch(sqlite3_column_type(s->handle, i)) {
+			case SQLITE_INTEGER:
+				sqlite3_snprintf(sizeof(num), num, "%lld", sqlite3_column_int64(s->handle, i));
+				csv_put(w, num, strlen(num));
+				break;
+			case SQLITE_FLOAT:
+				csv_put(w, num, format_double(num, sqlite3_column_double(s->handle, i), 1));
+				break;
+			case SQLITE_TEXT: {
+					const char* p = (const char*)sqlite3_column_text(s->handle, i);
+					csv_put_text(w, p, sqlite3_column_bytes(s->handle, i), delim, quote, 1);
+					break;
+				}
+			case SQLITE_BLOB: {
+					const char* p = (const char*)sqlite3_column_blob(s->handle, i);
+					csv_put_text(w, p, sqlite3_column_bytes(s->handle, i), delim, quote, 0);
+					break;
+				}
+			case SQLITE_NULL:
+			default:
+				csv_put(w, null, null_len);
+				break;
+			}
+		}
+		csv_put(w, newline, newline_len);
+		count++;
+	}
+
+	if(w->n && fwrite(w->buf, 1, w->n, fp) != w->n) w->error = 1;
+	if(stream) {
+		if(fflush(fp) != 0) w->error = 1;
+	} else if(fclose(fp) != 0) {
+		w->error = 1;
+	}
+	i = w->error;
+	sqlite3_free(w);
+
+	if(ret != SQLITE_DONE) return stmt_error(L, s, ret);
+	if(i) return luaL_error(L, "write error");
+	lua_pushinteger(L, count);
+	return 1;
+}
+
+
+/*
+ * Result encoding: stmt:encode_json(opts) and stmt:encode_msgpack(opts) step
+ * the statement and encode every row straight from the column values,
+ * without building Lua tables. Rows are objects keyed by column name, or
+ * arrays with opts.arrays. The result is a single array, returned as a
+ * string together with the row count, or written to the file handle
+ * opts.file in which case only the row count is returned.
+ *
+ * JSON: integers keep all 64 bits, NaN and infinities become null, BLOBs
+ * become base64 strings, invalid UTF-8 in TEXT becomes U+FFFD.
+ * MessagePack: integers and doubles use the smallest exact encoding, BLOBs
+ * are bin; the row count goes into the outer array32 header at the end.
+ * Written to opts.file the rows are a sequence of separate MessagePack
+ * objects without that header instead, so they can be streamed.
+ */
+#define ENC_BUFSIZE 65536 /* written out to opts.file whenever a row ends past this */
+
+/* length of the well-formed UTF-8 sequence starting p[0] >= 0x80, 0 if it is not one */
+static size_t utf8_sequence(const unsigned char* p, size_t n) {
+	unsigned cp;
+	size_t len, i;
+
+	if(p[0] < 0xc2) return 0; /* continuation byte or overlong */
+	if(p[0] < 0xe0) {
+		len = 2;
+		cp = p[0] & 0x1f;
+	} else if(p[0] < 0xf0) {
+		len = 3;
+		cp = p[0] & 0x0f;
+	} else if(p[0] < 0xf5) {
+		len = 4;
+		cp = p[0] & 0x07;
+	} else {
+		return 0;
+	}
+	if(len > n) return 0;
+	for(i = 1; i < len; i++) {
+		if((p[i] & 0xc0) != 0x80) return 0;
+		cp = cp << 6 | (p[i] & 0x3f);
+	}
+	if((len == 3 && cp < 0x800) || (len == 4 && (cp < 0x10000 || cp > 0x10ffff))
+			|| (cp >= 0xd800 && cp <= 0xdfff)) {
+		return 0;
+	}
+	return len;
+}
+
+static void json_put_string(enc_buffer* b, const unsigned char* p, size_t n) {
+	static const char hex[] = "0123456789abcdef";
+	size_t i;
+	size_t from = 0;
+
+	enc_put(b, "\"", 1);
+	for(i = 0; i < n; i++) {
+		unsigned char ch = p[i];
+		char esc[6] = {'\\', 'u', '0', '0', 0, 0};
+		size_t len = 2;
+
+		if(ch >= 0x20 && ch < 0x80 && ch != '"' && ch != '\\') continue;
+		if(ch >= 0x80) {
+			size_t seq = utf8_sequence(p + i, n - i);
+			if(seq) {
+				i += seq - 1;
+				continue;
+			}
+			enc_put(b, p + from, i - from);
+			enc_put(b, "\\ufffd", 6);
+			from = i + 1;
+			continue;
+		}
+		switch(ch) {
+		case '"':  esc[1] = '"'; break;
+		case '\\': esc[1] = '\\'; break;
+		case '\n': esc[1] = 'n'; break;
+		case '\r': esc[1] = 'r'; break;
+		case '\t': esc[1] = 't'; break;
+		case '\b': esc[1] = 'b'; break;
+		case '\f': esc[1] = 'f'; break;
+		default:
+			esc[4] = hex[ch >> 4];
+			esc[5] = hex[ch & 15];
+			len = 6;
+			break;
+		}
+		enc_put(b, p + from, i - from);
+		enc_put(b, esc, len);
+		from = i + 1;
+	}
+	enc_put(b, p + from, n - from);
+	enc_put(b, "\"", 1);
+}
+
+static void json_put_base64(enc_buffer* b, const unsigned char* p, size_t n) {
+	static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char out[256];
+	size_t len = 0;
+	size_t i;
+
+	enc_put(b, "\"", 1);
+	for(i = 0; i < n; i += 3) {
+		unsigned v = (unsigned)p[i] << 16;
+		if(i + 1 < n) v |= (unsigned)p[i + 1] << 8;
+		if(i + 2 < n) v |= p[i + 2];
+		out[len++] = b64[v >> 18];
+		out[len++] = b64[(v >> 12) & 63];
+		out[len++] = i + 1 < n ? b64[(v >> 6) & 63] : '=';
+		out[len++] = i + 2 < n ? b64[v & 63] : '=';
+		if(len == sizeof(out)) {
+			enc_put(b, out, len);
+			len = 0;
+		}
+	}
+	enc_put(b, out, len);
+	enc_put(b, "\"", 1);
+}
+
+static void json_put_column(enc_buffer* b, sqlite3_stmt* h, int i) {
+	char num[32];
+	switch(sqlite3_column_type(h, i)) {
+	case SQLITE_INTEGER:
+		enc_put(b, num, format_int64(num, sqlite3_column_int64(h, i)));
+		break;
+	case SQLITE_FLOAT: {
+			double d = sqlite3_column_double(h, i);
+			if(d - d != 0) { /* NaN or infinite */
+				enc_put(b, "null", 4);
+				break;
+			}
+			enc_put(b, num, format_double(num, d, 1));
+			break;
+		}
+	case SQLITE_TEXT:
+		json_put_string(b, sqlite3_column_text(h, i), sqlite3_column_bytes(h, i));
+		break;
+	case SQLITE_BLOB:
+		json_put_base64(b, sqlite3_column_blob(h, i), sqlite3_column_bytes(h, i));
+		break;
+	case SQLITE_NULL:
+	default:
+		enc_put(b, "null", 4);
+		break;
+	}
+}
+
+/* tag followed by the low bytes of v, big-endian */
+static void mp_put_tagged(enc_buffer* b, int tag, sqlite3_uint64 v, int bytes) {
+	unsigned char head[9];
+	int i;
+
+	head[0] = (unsigned char)tag;
+	for(i = bytes; i > 0; i--) {
+		head[i] = (unsigned char)v;
+		v >>= 8;
+	}
+	enc_put(b, head, bytes + 1);
+}
+
+/* str, bin, array and map headers; fix and tag8 are -1 for formats without them */
+static void mp_put_length(enc_buffer* b, size_t n, int fix, size_t fix_max, int tag8, int tag16) {
+	if(fix >= 0 && n <= fix_max) {
+		mp_put_tagged(b, fix | (int)n, 0, 0);
+	} else if(tag8 >= 0 && n <= 0xff) {
+		mp_put_tagged(b, tag8, n, 1);
+	} else if(n <= 0xffff) {
+		mp_put_tagged(b, tag16, n, 2);
+	} else {
+		mp_put_tagged(b, tag16 + 1, n, 4);
+	}
+}
+
+#define MP_PUT_STR(b, p, n) (mp_put_length((b), (n), 0xa0, 31, 0xd9, 0xda), enc_put((b), (p), (n)))
+
+static void mp_put_integer(enc_buffer* b, sqlite3_int64 v) {
+	if(v >= 0) {
+		if(v < 128) mp_put_tagged(b, (int)v, 0, 0);
+		else if(v <= 0xff) mp_put_tagged(b, 0xcc, v, 1);
+		else if(v <= 0xffff) mp_put_tagged(b, 0xcd, v, 2);
+		else if(v <= 0xffffffffLL) mp_put_tagged(b, 0xce, v, 4);
+		else mp_put_tagged(b, 0xcf, v, 8);
+	} else {
+		if(v >= -32) mp_put_tagged(b, (int)(v & 0xff), 0, 0);
+		else if(v >= -128) mp_put_tagged(b, 0xd0, v, 1);
+		else if(v >= -32768) mp_put_tagged(b, 0xd1, v, 2);
+		else if(v >= -2147483647LL - 1) mp_put_tagged(b, 0xd2, v, 4);
+		else mp_put_tagged(b, 0xd3, v, 8);
+	}
+}
+
+static void mp_put_column(enc_buffer* b, sqlite3_stmt* h, int i) {
+	switch(sqlite3_column_type(h, i)) {
+	case SQLITE_INTEGER:
+		mp_put_integer(b, sqlite3_column_int64(h, i));
+		break;
+	case SQLITE_FLOAT: {
+			double d = sqlite3_column_double(h, i);
+			sqlite3_uint64 bits;
+			memcpy(&bits, &d, sizeof(bits));
+			mp_put_tagged(b, 0xcb, bits, 8);
+			break;
+		}
+	case SQLITE_TEXT: {
+			const unsigned char* p = sqlite3_column_text(h, i);
+			MP_PUT_STR(b, p, (size_t)sqlite3_column_bytes(h, i));
+			break;
+		}
+	case SQLITE_BLOB: {
+			const void* p = sqlite3_column_blob(h, i);
+			size_t n = sqlite3_column_bytes(h, i);
+			mp_put_length(b, n, -1, 0, 0xc4, 0xc5);
+			if(n) enc_put(b, p, n);
+			break;
+		}
+	case SQLITE_NULL:
+	default:
+		mp_put_tagged(b, 0xc0, 0, 0);
+		break;
+	}
+}
+
+static int encode_rows(lua_State* L, int msgpack) {
+	stmt* s = (stmt*)luaL_checkudata(L, 1, MT_STMT);
+	int arrays = opt_boolean(L, 2, "arrays", 0);
+	int col_count = sqlite3_column_count(s->handle);
+	luaL_Stream* stream = NULL;
+	enc_buffer b = {NULL, 0, 0, 0};
+	enc_buffer keys = {NULL, 0, 0, 0};
+	size_t* key_ends = NULL;
+	lua_Integer count = 0;
+	int ret = SQLITE_DONE;
+	int write_error = 0;
+	int oom;
+	int i;
+
+	lua_settop(L, 2);
+	if(lua_istable(L, 2)) {
+		lua_getfield(L, 2, "file");
+		if(!lua_isnil(L, 3)) {
+			if((stream = (luaL_Stream*)luaL_testudata(L, 3, LUA_FILEHANDLE)) == NULL) {
+				return luaL_argerror(L, 2, "file must be a file handle");
+			}
+			if(stream->closef == NULL) return luaL_argerror(L, 2, "attempt to use a closed file");
+		}
+	}
+
+	/* object keys are encoded once */
+	if(!arrays) {
+		if((key_ends = sqlite3_malloc64(sizeof(size_t) * (col_count + 1))) == NULL) {
+			return luaL_error(L, "out of memory");
+		}
+		for(i = 0; i < col_count; i++) {
+			const char* name = sqlite3_column_name(s->handle, i);
+			if(msgpack) {
+				MP_PUT_STR(&keys, name, strlen(name));
+			} else {
+				json_put_string(&keys, (const unsigned char*)name, strlen(name));
+				enc_put(&keys, ":", 1);
+			}
+			key_ends[i] = keys.n;
+		}
+		b.oom = keys.oom;
+	}
+
+	if(msgpack) {
+		if(!stream) mp_put_tagged(&b, 0xdd, 0, 4); /* array32, count filled in below */
+	} else {
+		enc_put(&b, "[", 1);
+	}
+
+	while(!b.oom && !write_error && (ret = stmt_step(L, s)) == SQLITE_ROW) {
+		if(msgpack) {
+			if(arrays) mp_put_length(&b, col_count, 0x90, 15, -1, 0xdc);
+			else mp_put_length(&b, col_count, 0x80, 15, -1, 0xde);
+		} else {
+			if(count) enc_put(&b, ",", 1);
+			enc_put(&b, arrays ? "[" : "{", 1);
+		}
+		for(i = 0; i < col_count; i++) {
+			if(!msgpack && i) enc_put(&b, ",", 1);
+			if(!arrays) {
+				size_t from = i ? key_ends[i - 1] : 0;
+				enc_put(&b, keys.p + from, key_ends[i] - from);
+			}
+			if(msgpack) mp_put_column(&b, s->handle, i);
+			else json_put_column(&b, s->handle, i);
+		}
+		if(!msgpack) enc_put(&b, arrays ? "]" : "}", 1);
+		count++;
+
+		if(stream && b.n >= ENC_BUFSIZE) {
+			if(fwrite(b.p, 1, b.n, stream->f) != b.n) write_error = 1;
+			b.n = 0;
+		}
+	}
+
+	if(msgpack) {
+		if(!stream && !b.oom) {
+			b.p[1] = (unsigned char)(count >> 24);
+			b.p[2] = (unsigned char)(count >> 16);
+			b.p[3] = (unsigned char)(count >> 8);
+			b.p[4] = (unsigned char)count;
+		}
+	} else {
+		enc_put(&b, "]", 1);
+	}
+
+	oom = b.oom;
+	if(stream) {
+		if(!oom && b.n && fwrite(b.p, 1, b.n, stream->f) != b.n) write_error = 1;
+		if(fflush(stream->f) != 0) write_error = 1;
+	} else if(!oom) {
+		lua_pushlstring(L, (const char*)b.p, b.n);
+	}
+	sqlite3_free(b.p);
+	sqlite3_free(keys.p);
+	sqlite3_free(key_ends);
+
+	if(ret != SQLITE_DONE && ret != SQLITE_ROW) return stmt_error(L, s, ret);
+	if(oom) return luaL_error(L, "out of memory");
+	if(write_error) return luaL_error(L, "write error");
+	lua_pushinteger(L, count);
+	return stream ? 1 : 2;
+}
+
+LUA_FUNC(stmtlib_encode_json) {
+	return encode_rows(L, 0);
+}
+
+LUA_FUNC(stmtlib_encode_msgpack) {
+	return encode_rows(L, 1);
+}
 
+LUA_FUNC(stmtlib_finalize) {
+	stmt* s = (stmt*)luaL_checkudata(L, 1, MT_STMT);
+
+	if(s->c) {
+		sqlite3_stmt* handle = s->handle;
+		int ret;
+
+		stmt_unlink(s);
+		s->handle = NULL;
+		if((ret = sqlite3_finalize(handle)) != SQLITE_OK) {
+			return luaL_error(L, "[%d] %s", ret, sqlite3_errmsg(sqlite3_db_handle(handle)));
+		}
+	}
+
+	return 0;
+}
+
+/* like finalize, but errors from the last step must not escape the collector */
+LUA_FUNC(stmtlib_gc) {
+	stmt* s = (stmt*)luaL_checkudata(L, 1, MT_STMT);
+
+	if(s->c) {
+		sqlite3_stmt* handle = s->handle;
+		stmt_unlink(s);
 		s->handle = NULL;
-		s->c = NULL;
+		sqlite3_finalize(handle);
 	}
 
 	return 0;
@@ -904,6 +4301,8 @@ static const luaL_Reg stmtlib[] = {
 	{"bind", stmtlib_bind},
 
 	{"exec_update", stmtlib_exec_update},
+	{"set_timeout", stmtlib_set_timeout},
+	{"set_cacheable", stmtlib_set_cacheable},
 
 	{"column_names", stmtlib_column_names},
 
@@ -913,10 +4312,17 @@ static const luaL_Reg stmtlib[] = {
 	{"ifetch", stmtlib_ifetch},
 	{"rows", stmtlib_rows},
 	{"irows", stmtlib_irows},
+	{"fetch_all", stmtlib_fetch_all},
+	{"ifetch_all", stmtlib_ifetch_all},
+	{"lazy_rows", stmtlib_lazy_rows},
+
+	{"export_csv", stmtlib_export_csv},
+	{"encode_json", stmtlib_encode_json},
+	{"encode_msgpack", stmtlib_encode_msgpack},
 
 	{"finalize", stmtlib_finalize},
 
-	{"__gc", stmtlib_finalize},
+	{"__gc", stmtlib_gc},
 	{"__tostring", stmtlib_tostring},
 	{NULL, NULL}
 };
@@ -946,5 +4352,9 @@ int luaopen_sqlite3(lua_State* L) {
 
 	createmeta(L, MT_CONN, connlib);
 	createmeta(L, MT_STMT, stmtlib);
+
+	luaL_newmetatable(L, MT_ROW);
+	luaL_setfuncs(L, rowlib, 0);
+	lua_pop(L, 1);
 	return 1;
 }
@@ -115,6 +115,161 @@ end)
 --c:rollback()
 c:commit()
 
+local config = {alpha = 1, beta = 2, gamma = 3}
+c:create_module("lua_config", {
+	schema = "CREATE TABLE x(key TEXT, value)",
+	best_index = function(self, info)
+		for i, cons in ipairs(info.constraints) do
+			if cons.usable and cons.column == 1 and cons.op == "=" then
+				cons.argv_index = 1
+				cons.omit = true
+				info.idx_num = 1
+				info.estimated_cost = 1
+				return
+			end
+		end
+	end,
+	open = function(self)
+		local cur = {}
+		function cur:filter(idx_num, idx_str, args)
+			self.keys = {}
+			if idx_num == 1 then
+				if config[args[1]] then self.keys[1] = args[1] end
+			else
+				for k in pairs(config) do self.keys[#self.keys + 1] = k end
+			end
+			self.i = 1
+		end
+		function cur:next() self.i = self.i + 1 end
+		function cur:eof() return self.i > #self.keys end
+		function cur:column(n)
+			local k = self.keys[self.i]
+			if n == 1 then return k end
+			return config[k]
+		end
+		return cur
+	end,
+})
+
+for row in c:prepare("select * from lua_config order by key"):rows() do
+	print("vtab  : " .. row.key, row.value)
+end
+for row in c:prepare("select value from lua_config where key = 'beta'"):rows() do
+	print("vtab  : beta", row.value)
+end
+
+p = c:prepare("select key, value from lua_config where key in carray(:keys) order by key")
+p:bind {keys = {'alpha', 'gamma', 'delta'}}
+for row in p:rows() do
+	print("carray: " .. row.key, row.value)
+end
+
+print("export: " .. c:prepare("select * from lua_config"):export_csv("test.csv"))
+print("import: " .. c:import_csv("config_copy", "test.csv"))
+for row in c:prepare("select * from config_copy"):rows() do
+	print("csv   : " .. row.key, row.value)
+end
+c:exec("drop table config_copy")
+
+m = sqlite3.open_memory()
+m:exec("create table snap(a, b); insert into snap values(1, 'one'); insert into snap values(2, 'two')")
+local image = m:serialize()
+m:close()
+m = sqlite3.open_memory()
+m:deserialize(image, {nocopy = true})
+for row in m:prepare("select * from snap"):rows() do
+	print("snap  : " .. row.a, row.b)
+end
+m:close()
+
+c:set_update_hook(function(changes, overflow)
+	for i, ch in ipairs(changes) do
+		print("update: " .. ch.op, ch.table, ch.rowid)
+	end
+end)
+c:begin()
+c:exec("create table watched(v); insert into watched values('a'); insert into watched values('b')")
+c:exec("update watched set v = 'c' where rowid = 1; delete from watched where rowid = 2")
+c:commit()
+c:exec("drop table watched")
+c:set_update_hook(nil)
+
+for row in c:prepare("select *, 'x' || key as tag from lua_config order by key"):lazy_rows() do
+	print("lazy  : " .. row.key, row[2], row.tag, #row)
+	last = row:copy()
+end
+print("copy  : " .. last.key, last.value, last.tag)
+
+c:set_result_cache(1024 * 1024)
+c:exec("create table cached(a); insert into cached values(1); insert into cached values(2)")
+p = c:prepare("select sum(a) as total from cached where a > :min")
+p:set_cacheable(true)
+for i = 1, 3 do
+	p:bind {min = 0}
+	print("cache : " .. p:fetch_all()[1].total)
+end
+c:exec("insert into cached values(3)")
+p:bind {min = 0}
+print("cache : " .. p:ifetch_all()[1][1])
+for k, v in pairs(c:result_cache_stats()) do print("stats : " .. k, v) end
+c:exec("drop table cached")
+c:set_result_cache(nil)
+
+p = c:prepare("with recursive r(x) as (select 1 union all select x + 1 from r) select count(*) from r")
+p:set_timeout(50)
+print("timeout: ", pcall(p.fetch, p))
+for i, q in ipairs(c:aborted_queries()) do
+	print("aborted: " .. q.sql, q.elapsed_ms, q.opcodes, q.timed_out)
+end
+
+c:exec("create table versions(v text); insert into versions values('1.10'); insert into versions values('1.9'); insert into versions values('1.0-rc1'); insert into versions values('1.0')")
+for row in c:prepare("select v from versions order by v collate VERSION"):rows() do
+	print("version: " .. row.v)
+end
+c:set_collation("BY_LENGTH", function(a, b) return #a - #b end)
+for row in c:prepare("select v from versions order by v collate BY_LENGTH, v collate NATSORT"):rows() do
+	print("length : " .. row.v)
+end
+c:exec("drop table versions")
+
+c:exec("create table events(id integer primary key, name text not null)")
+c:set_write_batching {max_count = 3, max_delay_ms = 1000}
+p = c:prepare("insert into events(name) values(:name)")
+local tickets = {
+	c:submit_write(p, {name = 'first'}),
+	c:submit_write(p, {}, function(ok, err) print("write : failed as expected", ok) end),
+	c:submit_write(function() return c:prepare("select count(*) from events"):ifetch_all()[1][1] end),
+}
+for i, t in ipairs(tickets) do
+	print("ticket: " .. i, t.done, t.ok, t.result, t.error)
+end
+c:submit_write(p, {name = 'late'})
+print("pending: " .. c:pending_writes(), c:flush_writes())
+c:exec("drop table events")
+
+for i = 1, 100 do c:prepare("select " .. i) end
+collectgarbage()
+print("statements: " .. #c:statements())
+for _, st in ipairs(c:statements()) do print("live  : " .. st.sql, st.busy, st.readonly) end
+
+c:set_wal_hook(function(schema, pages) print("wal   : " .. schema, pages) end)
+print("ckpt  : ", c:checkpoint("truncate"))
+print("vacuum: " .. c:incremental_vacuum(16))
+local m = c:maintenance {budget_ms = 20, vacuum_step = 32}
+print("maint : ", m.log, m.checkpointed, m.vacuumed, m.optimized, m.more)
+c:set_wal_hook(nil)
+
+p = c:prepare("select 9007199254740993 as id, 0.1 as x, 'say \"hi\"' || char(10) as s, x'00ff' as b, null as n")
+print("json  : " .. p:encode_json())
+p:reset()
+print("json  : " .. p:encode_json {arrays = true})
+p:reset()
+local mp, n = p:encode_msgpack()
+print("msgpck: " .. #mp .. " bytes, " .. n .. " rows")
+p:reset()
+p:encode_json {file = io.stdout}
+print()
+
 
 
 